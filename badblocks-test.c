@@ -0,0 +1,187 @@
+#include "blkdev.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#define NBLKS 4096
+
+/* block 'blk' onwards of the test pattern */
+static void fill(char *buf, lba_t blk, lba_t n)
+{
+    for (lba_t i = 0; i < n * BLOCK_SIZE; i++)
+        buf[i] = (char)((blk * BLOCK_SIZE + i) * 7 + 3);
+}
+
+static int check(char *buf, lba_t blk, lba_t n)
+{
+    char *want = malloc(n * BLOCK_SIZE);
+    fill(want, blk, n);
+    int same = memcmp(buf, want, n * BLOCK_SIZE) == 0;
+    free(want);
+    return same;
+}
+
+/* a sim device over a ramdisk whose blocks [first, first+n) are bad */
+static struct blkdev *bad_disk(lba_t nblks, lba_t first, lba_t n)
+{
+    struct sim_params p;
+    memset(&p, 0, sizeof(p));
+    p.bad_first = first;
+    p.bad_blocks = n;
+    return sim_create(ramdisk_create(nblks), &p);
+}
+
+static void set_bad(struct blkdev *sim, lba_t first, lba_t n)
+{
+    struct sim_params p;
+    memset(&p, 0, sizeof(p));
+    p.bad_first = first;
+    p.bad_blocks = n;
+    sim_configure(sim, &p);
+}
+
+int main() {
+    char *buf = malloc(64 * BLOCK_SIZE);
+    struct blkdev_stats st;
+
+    // the spares and their table come off the end
+    struct blkdev *sim = bad_disk(NBLKS, 100, 2);
+    struct blkdev *dev = badblocks_create(sim, 64);
+    assert(blkdev_num_blocks(dev) == NBLKS - 64 - 3 - 1);
+
+    // a write over bad blocks moves them to spares, and reads find them
+    fill(buf, 96, 16);
+    assert(blkdev_write(dev, 96, 16, buf) == SUCCESS);
+    assert(blkdev_get_stats(dev, &st) == SUCCESS && st.remapped == 2);
+    memset(buf, 0, 16 * BLOCK_SIZE);
+    assert(blkdev_read(dev, 96, 16, buf) == SUCCESS && check(buf, 96, 16));
+    assert(blkdev_read(dev, 101, 1, buf) == SUCCESS && check(buf, 101, 1));
+
+    // rewriting them goes straight to the spares
+    fill(buf, 100, 2);
+    assert(blkdev_write(dev, 100, 2, buf) == SUCCESS);
+    assert(blkdev_get_stats(dev, &st) == SUCCESS && st.remapped == 2);
+
+    // once the 62 spares left run out, the write fails
+    set_bad(sim, 200, 100);
+    fill(buf, 200, 62);
+    assert(blkdev_write(dev, 200, 62, buf) == SUCCESS);
+    assert(blkdev_write(dev, 264, 8, buf) == E_UNAVAIL);
+    assert(blkdev_get_stats(dev, &st) == SUCCESS && st.remapped == 64);
+    blkdev_close(dev);
+
+    // the table persists: reopened without the bad patch, the data is
+    // still found in the spares, not the blocks it was meant for
+    FILE *fp = fopen("test1", "w");
+    assert(fp != NULL && ftruncate(fileno(fp), NBLKS * BLOCK_SIZE) == 0);
+    fclose(fp);
+    struct sim_params p;
+    memset(&p, 0, sizeof(p));
+    p.bad_first = 10;
+    p.bad_blocks = 3;
+    dev = badblocks_create(sim_create(image_create("test1"), &p), 16);
+    fill(buf, 8, 8);
+    assert(blkdev_write(dev, 8, 8, buf) == SUCCESS);
+    blkdev_close(dev);
+    dev = badblocks_create(image_create("test1"), 64);
+    assert(blkdev_num_blocks(dev) == NBLKS - 16 - 1 - 1);
+    assert(blkdev_read(dev, 8, 8, buf) == SUCCESS && check(buf, 8, 8));
+    blkdev_close(dev);
+    struct blkdev *raw = image_create("test1");
+    assert(blkdev_read(raw, 10, 1, buf) == SUCCESS && buf[0] == 0);
+    blkdev_close(raw);
+
+    // a header whose extent count can't be right is ignored, and the
+    // device gets a new, empty table
+    raw = image_create("test1");
+    assert(blkdev_read(raw, NBLKS - 1, 1, buf) == SUCCESS);
+    int64_t count = -1;
+    memcpy(buf + 32, &count, sizeof(count));    // bb_header.count
+    assert(blkdev_write(raw, NBLKS - 1, 1, buf) == SUCCESS);
+    blkdev_close(raw);
+    dev = badblocks_create(image_create("test1"), 64);
+    assert(blkdev_num_blocks(dev) == NBLKS - 64 - 3 - 1);
+    assert(blkdev_read(dev, 10, 1, buf) == SUCCESS && buf[0] == 0);
+    blkdev_close(dev);
+
+    // under raid4, a read error is reconstructed and written back to a
+    // spare; the array never degrades
+    struct blkdev *sims[3], *members[3];
+    for (int i = 0; i < 3; i++)
+        members[i] = badblocks_create(sims[i] = bad_disk(NBLKS, 0, 0), 16);
+    struct blkdev *raid4 = raid4_create(3, members, 4);
+    fill(buf, 0, 64);
+    assert(blkdev_write(raid4, 0, 64, buf) == SUCCESS);
+    set_bad(sims[1], 9, 1);     // block 21 of the array
+    memset(buf, 0, 64 * BLOCK_SIZE);
+    assert(blkdev_read(raid4, 16, 16, buf) == SUCCESS && check(buf, 16, 16));
+    assert(blkdev_get_stats(raid4, &st) == SUCCESS);
+    assert(st.read_repairs == 4 && st.degraded_reads == 0);
+    assert(blkdev_get_stats(members[1], &st) == SUCCESS && st.remapped == 1);
+    assert(blkdev_read(raid4, 0, 64, buf) == SUCCESS && check(buf, 0, 64));
+    assert(blkdev_get_stats(raid4, &st) == SUCCESS);
+    assert(st.read_repairs == 4 && st.degraded_reads == 0);
+
+    // writes over a bad patch are remapped below the array too
+    set_bad(sims[2], 0, 2);     // parity
+    fill(buf, 0, 8);
+    assert(blkdev_write(raid4, 0, 8, buf) == SUCCESS);
+    assert(blkdev_get_stats(members[2], &st) == SUCCESS && st.remapped == 2);
+    struct raid_scrub s = {0};
+    assert(raid_scrub(raid4, &s) == SUCCESS && s.mismatched == 0);
+
+    // so are partial writes whose old data or parity can't be read:
+    // they are reconstructed from the rest of the row instead
+    set_bad(sims[0], 20, 1);    // block 40 of the array
+    set_bad(sims[2], 28, 1);    // parity of block 56
+    fill(buf, 40, 1);
+    assert(blkdev_write(raid4, 40, 1, buf) == SUCCESS);
+    fill(buf, 56, 1);
+    assert(blkdev_write(raid4, 56, 1, buf) == SUCCESS);
+    assert(blkdev_get_stats(members[0], &st) == SUCCESS && st.remapped == 1);
+    assert(blkdev_get_stats(members[2], &st) == SUCCESS && st.remapped == 3);
+    assert(blkdev_read(raid4, 0, 64, buf) == SUCCESS && check(buf, 0, 64));
+    assert(blkdev_get_stats(raid4, &st) == SUCCESS && st.degraded_reads == 0);
+    memset(&s, 0, sizeof(s));
+    assert(raid_scrub(raid4, &s) == SUCCESS && s.mismatched == 0);
+
+    // and a scrub that can't read a strip rewrites it from the others
+    set_bad(sims[1], 40, 1);    // block 84 of the array
+    memset(&s, 0, sizeof(s));
+    s.flags = RAID_SCRUB_REPAIR;
+    assert(raid_scrub(raid4, &s) == SUCCESS && s.mismatched == 4 && s.repaired == 4);
+    assert(blkdev_get_stats(members[1], &st) == SUCCESS && st.remapped == 2);
+    assert(blkdev_read(raid4, 0, 64, buf) == SUCCESS && check(buf, 0, 64));
+    assert(blkdev_get_stats(raid4, &st) == SUCCESS && st.degraded_reads == 0);
+    blkdev_close(raid4);
+
+    // a mirror does the same
+    struct blkdev *legs[2];
+    sims[0] = bad_disk(NBLKS, 0, 0);
+    legs[0] = badblocks_create(sims[0], 16);
+    legs[1] = badblocks_create(ramdisk_create(NBLKS), 16);
+    struct blkdev *mirror = mirror_create(legs);
+    fill(buf, 0, 64);
+    assert(blkdev_write(mirror, 0, 64, buf) == SUCCESS);
+    set_bad(sims[0], 40, 4);
+    memset(buf, 0, 64 * BLOCK_SIZE);
+    assert(blkdev_read(mirror, 32, 16, buf) == SUCCESS && check(buf, 32, 16));
+    assert(blkdev_get_stats(mirror, &st) == SUCCESS && st.read_repairs == 16);
+    assert(blkdev_get_stats(legs[0], &st) == SUCCESS && st.remapped == 4);
+    assert(blkdev_read(legs[0], 32, 16, buf) == SUCCESS && check(buf, 32, 16));
+
+    // and so does its scrub, keeping both legs
+    set_bad(sims[0], 100, 1);
+    memset(&s, 0, sizeof(s));
+    s.flags = RAID_SCRUB_REPAIR;
+    assert(raid_scrub(mirror, &s) == SUCCESS && s.mismatched == 64 && s.repaired == 64);
+    assert(blkdev_get_stats(legs[0], &st) == SUCCESS && st.remapped == 5);
+    memset(&s, 0, sizeof(s));
+    assert(raid_scrub(mirror, &s) == SUCCESS && s.mismatched == 0);
+    blkdev_close(mirror);
+
+    free(buf);
+    printf("badblocks test passed\n");
+}
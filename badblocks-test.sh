@@ -0,0 +1,2 @@
+gcc -g -w -pthread -o badblocks-test badblocks-test.c badblocks.c sim.c ramdisk.c image.c raid.c integrity.c -lm && ./badblocks-test &&
+rm test[0-9]*
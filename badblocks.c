@@ -0,0 +1,520 @@
+/*
+ * file:        badblocks.c
+ * description: bad block remapping, stackable in front of any blkdev
+ *
+ * The layer reserves a spare area near the end of the device
+ * underneath. A write that fails with E_UNAVAIL is tried again a block
+ * at a time, and each block that still fails is moved to the next free
+ * spare block: the data goes there, and an extent mapping the block to
+ * it goes into the bad block table. Only when the spares run out, or a
+ * spare can't be written either, does the write fail - the disk is
+ * taken to be dead rather than to have a bad patch.
+ *
+ * A read can't be remapped, since the data is gone; it fails, and the
+ * RAID layer above reconstructs the blocks and writes them back, which
+ * remaps them. Under a mirror or raid4 an isolated media error costs a
+ * few spare blocks instead of a degraded array and a full rebuild.
+ *
+ * The table is a sorted array of extents, searched by bisection, and
+ * is kept on the device after the spare area, with a header in the
+ * last block. It is written (with FUA) before a remapping is used. In
+ * memory it is copied on change and the new copy published with one
+ * pointer store, so I/O never takes a lock, and I/O to a device with
+ * nothing remapped doesn't look at the table at all. Old copies are
+ * kept until close.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "blkdev.h"
+
+#define BADBLOCKS_DEV_MAGIC 0x12340040
+#define BADBLOCKS_MAGIC 0x31424242      /* "BBB1" in the header block */
+
+struct bb_header {
+    uint32_t magic;
+    uint32_t bs;
+    int64_t nblks;
+    int64_t nspare;
+    int64_t used;                       /* spare blocks handed out */
+    int64_t count;                      /* extents in the table */
+};
+
+/* blocks [first, first+n) live at [spare, spare+n) */
+struct bb_extent {
+    int64_t first;
+    int64_t n;
+    int64_t spare;
+};
+
+struct bb_table {
+    struct bb_table *prev;              /* older copies, freed on close */
+    int count;
+    struct bb_extent ext[];
+};
+
+struct bb_dev {
+    int magic;
+    struct blkdev *dev;
+    lba_t nblks;                /* usable blocks */
+    lba_t spare;                /* first spare block */
+    lba_t nspare;
+    lba_t used;
+    lba_t table_blk;            /* where the table is kept... */
+    lba_t ntable;               /* ... in this many blocks */
+    int bs;
+    struct bb_table *table;     /* current copy, read without a lock */
+    pthread_mutex_t lock;       /* held while remapping */
+    struct blkdev_stats stats;
+};
+
+static struct bb_table *bb_current(struct bb_dev *bd)
+{
+    return __atomic_load_n(&bd->table, __ATOMIC_ACQUIRE);
+}
+
+/* where block 'blk' is, and how many of the next 'n' blocks follow on
+ * from it; *remapped is set if they are in the spare area
+ */
+static lba_t bb_map(struct bb_table *t, lba_t blk, lba_t n, lba_t *phys, int *remapped)
+{
+    int lo = 0, hi = t->count;
+
+    while (lo < hi) {                   /* first extent starting after blk */
+        int mid = (lo + hi) / 2;
+        if (t->ext[mid].first <= blk)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo > 0 && blk < t->ext[lo - 1].first + t->ext[lo - 1].n) {
+        struct bb_extent *e = &t->ext[lo - 1];
+        *phys = e->spare + (blk - e->first);
+        *remapped = 1;
+        return e->first + e->n - blk < n ? e->first + e->n - blk : n;
+    }
+    *phys = blk;
+    *remapped = 0;
+    return lo < t->count && t->ext[lo].first - blk < n ? t->ext[lo].first - blk : n;
+}
+
+/* the table with 'blk' mapped to 'spare', merged into the extent before
+ * it if both carry on from it; NULL if there's no memory for it
+ */
+static struct bb_table *bb_insert(struct bb_table *t, lba_t blk, lba_t spare)
+{
+    struct bb_table *nt = malloc(sizeof(*nt) + (t->count + 1) * sizeof(nt->ext[0]));
+    int i = 0, j = 0;
+
+    if (nt == NULL)
+        return NULL;
+    while (i < t->count && t->ext[i].first < blk)
+        nt->ext[j++] = t->ext[i++];
+    if (j > 0 && nt->ext[j - 1].first + nt->ext[j - 1].n == blk &&
+        nt->ext[j - 1].spare + nt->ext[j - 1].n == spare) {
+        nt->ext[j - 1].n++;
+    } else {
+        nt->ext[j].first = blk;
+        nt->ext[j].n = 1;
+        nt->ext[j].spare = spare;
+        j++;
+    }
+    while (i < t->count)
+        nt->ext[j++] = t->ext[i++];
+    nt->count = j;
+    nt->prev = t;
+    return nt;
+}
+
+/* write table 't' and then the header, durably */
+static int bb_save(struct bb_dev *bd, struct bb_table *t, lba_t used)
+{
+    char *buf = calloc(bd->ntable, bd->bs);
+    struct bb_header h;
+    int val;
+
+    if (buf == NULL)
+        return E_UNAVAIL;
+    memcpy(buf, t->ext, t->count * sizeof(t->ext[0]));
+    val = blkdev_write_flags(bd->dev, bd->table_blk, bd->ntable, buf, BLKDEV_FUA);
+    if (val == SUCCESS) {
+        memset(&h, 0, sizeof(h));
+        h.magic = BADBLOCKS_MAGIC;
+        h.bs = bd->bs;
+        h.nblks = bd->nblks;
+        h.nspare = bd->nspare;
+        h.used = used;
+        h.count = t->count;
+        memset(buf, 0, bd->bs);
+        memcpy(buf, &h, sizeof(h));
+        val = blkdev_write_flags(bd->dev, bd->table_blk + bd->ntable, 1, buf, BLKDEV_FUA);
+    }
+    free(buf);
+    return val;
+}
+
+/* a write of [first, first+n) failed: write it a block at a time, and
+ * move each block that fails to a spare. Holds the lock throughout, so
+ * two writers can't remap the same block twice.
+ */
+static int bb_remap(struct bb_dev *bd, lba_t first, lba_t n, char *buf, int flags)
+{
+    struct bb_table *t, *nt;
+    lba_t i, phys, slot;
+    int val = SUCCESS, remapped;
+
+    pthread_mutex_lock(&bd->lock);
+    for (i = 0; i < n && val == SUCCESS; i++, buf += bd->bs) {
+        t = bb_current(bd);
+        bb_map(t, first + i, 1, &phys, &remapped);
+        val = blkdev_write_flags(bd->dev, phys, 1, buf, flags);
+        if (val != E_UNAVAIL || remapped)
+            continue;
+        if (bd->used == bd->nspare)
+            break;
+        slot = bd->spare + bd->used;
+        val = blkdev_write_flags(bd->dev, slot, 1, buf, flags);
+        if (val != SUCCESS)
+            break;
+        nt = bb_insert(t, first + i, slot);
+        if (nt == NULL) {
+            val = E_UNAVAIL;
+            break;
+        }
+        val = bb_save(bd, nt, bd->used + 1);
+        if (val != SUCCESS) {
+            free(nt);
+            break;
+        }
+        bd->used++;
+        __atomic_store_n(&bd->table, nt, __ATOMIC_RELEASE);
+        blkdev_stats_add(&bd->stats.remapped, 1);
+    }
+    pthread_mutex_unlock(&bd->lock);
+    return val;
+}
+
+static int bb_in_range(struct bb_dev *bd, lba_t first, lba_t n)
+{
+    return first >= 0 && n >= 0 && first <= bd->nblks - n;
+}
+
+static int bb_read_blocks(struct blkdev *dev, lba_t first_blk, lba_t num_blks, void *buf)
+{
+    struct bb_dev *bd = dev->private;
+    struct bb_table *t = bb_current(bd);
+    lba_t n, phys;
+    int val = SUCCESS, remapped;
+
+    assert(bd->magic == BADBLOCKS_DEV_MAGIC);
+    if (!bb_in_range(bd, first_blk, num_blks))
+        return E_BADADDR;
+    if (t->count == 0)
+        return bd->dev->ops->read(bd->dev, first_blk, num_blks, buf);
+    while (num_blks > 0 && val == SUCCESS) {
+        n = bb_map(t, first_blk, num_blks, &phys, &remapped);
+        val = bd->dev->ops->read(bd->dev, phys, n, buf);
+        first_blk += n;
+        num_blks -= n;
+        buf = (char *)buf + (size_t)n * bd->bs;
+    }
+    return val;
+}
+
+static int bb_write_blocks(struct blkdev *dev, lba_t first_blk, lba_t num_blks, void *buf,
+                           int flags)
+{
+    struct bb_dev *bd = dev->private;
+    struct bb_table *t = bb_current(bd);
+    lba_t n, phys;
+    int val = SUCCESS, remapped;
+
+    assert(bd->magic == BADBLOCKS_DEV_MAGIC);
+    if (!bb_in_range(bd, first_blk, num_blks))
+        return E_BADADDR;
+    while (num_blks > 0 && val == SUCCESS) {
+        t = bb_current(bd);             /* a remap may have come in between */
+        n = bb_map(t, first_blk, num_blks, &phys, &remapped);
+        val = blkdev_write_flags(bd->dev, phys, n, buf, flags);
+        if (val == E_UNAVAIL && !remapped)
+            val = bb_remap(bd, first_blk, n, buf, flags);
+        first_blk += n;
+        num_blks -= n;
+        buf = (char *)buf + (size_t)n * bd->bs;
+    }
+    return val;
+}
+
+/* discard and write_zeroes go wherever the blocks are */
+static int bb_region_op_blocks(struct blkdev *dev, int op, lba_t first_blk, lba_t num_blks)
+{
+    struct bb_dev *bd = dev->private;
+    struct bb_table *t = bb_current(bd);
+    lba_t n, phys;
+    int val = SUCCESS, remapped;
+
+    if (!bb_in_range(bd, first_blk, num_blks))
+        return E_BADADDR;
+    while (num_blks > 0 && val == SUCCESS) {
+        n = bb_map(t, first_blk, num_blks, &phys, &remapped);
+        if (op == BLKDEV_OP_DISCARD)
+            val = blkdev_discard(bd->dev, phys, n);
+        else
+            val = blkdev_write_zeroes(bd->dev, phys, n);
+        first_blk += n;
+        num_blks -= n;
+    }
+    return val;
+}
+
+static lba_t bb_num_blocks(struct blkdev *dev)
+{
+    struct bb_dev *bd = dev->private;
+    return bd->nblks;
+}
+
+static int bb_block_size(struct blkdev *dev)
+{
+    struct bb_dev *bd = dev->private;
+    return bd->bs;
+}
+
+static int bb_read(struct blkdev *dev, lba_t first_blk, lba_t num_blks, void *buf)
+{
+    struct bb_dev *bd = dev->private;
+    unsigned long t0 = blkdev_stats_start();
+    int val = bb_read_blocks(dev, first_blk, num_blks, buf);
+    blkdev_stats_end(&bd->stats, BLKDEV_OP_READ, num_blks, val, t0);
+    return val;
+}
+
+static int bb_write_flags(struct blkdev *dev, lba_t first_blk, lba_t num_blks, void *buf,
+                          int flags)
+{
+    struct bb_dev *bd = dev->private;
+    unsigned long t0 = blkdev_stats_start();
+    int val = bb_write_blocks(dev, first_blk, num_blks, buf, flags);
+    blkdev_stats_end(&bd->stats, BLKDEV_OP_WRITE, num_blks, val, t0);
+    return val;
+}
+
+static int bb_write(struct blkdev *dev, lba_t first_blk, lba_t num_blks, void *buf)
+{
+    return bb_write_flags(dev, first_blk, num_blks, buf, 0);
+}
+
+static int bb_discard(struct blkdev *dev, lba_t first_blk, lba_t num_blks)
+{
+    struct bb_dev *bd = dev->private;
+    unsigned long t0 = blkdev_stats_start();
+    int val = bb_region_op_blocks(dev, BLKDEV_OP_DISCARD, first_blk, num_blks);
+    blkdev_stats_end(&bd->stats, BLKDEV_OP_DISCARD, num_blks, val, t0);
+    return val;
+}
+
+static int bb_write_zeroes(struct blkdev *dev, lba_t first_blk, lba_t num_blks)
+{
+    struct bb_dev *bd = dev->private;
+    unsigned long t0 = blkdev_stats_start();
+    int val = bb_region_op_blocks(dev, BLKDEV_OP_WRITE_ZEROES, first_blk, num_blks);
+    blkdev_stats_end(&bd->stats, BLKDEV_OP_WRITE_ZEROES, num_blks, val, t0);
+    return val;
+}
+
+static int bb_flush(struct blkdev *dev)
+{
+    struct bb_dev *bd = dev->private;
+    unsigned long t0 = blkdev_stats_start();
+    int val = blkdev_flush(bd->dev);
+    blkdev_stats_end(&bd->stats, BLKDEV_OP_FLUSH, 0, val, t0);
+    return val;
+}
+
+/* remapped blocks are always data */
+static int bb_map_extent(struct blkdev *dev, lba_t first_blk, lba_t num_blks, lba_t *len)
+{
+    struct bb_dev *bd = dev->private;
+    lba_t phys;
+    int remapped;
+
+    if (!bb_in_range(bd, first_blk, num_blks))
+        return E_BADADDR;
+    num_blks = bb_map(bb_current(bd), first_blk, num_blks, &phys, &remapped);
+    if (remapped) {
+        *len = num_blks;
+        return BLKDEV_EXTENT_DATA;
+    }
+    return blkdev_map_extent(bd->dev, first_blk, num_blks, len);
+}
+
+static struct blkdev_stats *bb_stats(struct blkdev *dev)
+{
+    struct bb_dev *bd = dev->private;
+    return &bd->stats;
+}
+
+static int bb_members(struct blkdev *dev, struct blkdev **out, int max)
+{
+    struct bb_dev *bd = dev->private;
+    if (max < 1)
+        return 0;
+    out[0] = bd->dev;
+    return 1;
+}
+
+static void bb_close(struct blkdev *dev)
+{
+    struct bb_dev *bd = dev->private;
+    struct bb_table *t, *prev;
+
+    assert(bd->magic == BADBLOCKS_DEV_MAGIC);
+    bd->dev->ops->close(bd->dev);
+    for (t = bd->table; t != NULL; t = prev) {
+        prev = t->prev;
+        free(t);
+    }
+    pthread_mutex_destroy(&bd->lock);
+    free(bd);
+    free(dev);
+}
+
+struct blkdev_ops badblocks_ops = {
+    .num_blocks = bb_num_blocks,
+    .read = bb_read,
+    .write = bb_write,
+    .close = bb_close,
+    .stats = bb_stats,
+    .members = bb_members,
+    .block_size = bb_block_size,
+    .discard = bb_discard,
+    .write_zeroes = bb_write_zeroes,
+    .flush = bb_flush,
+    .write_flags = bb_write_flags,
+    .map_extent = bb_map_extent,
+    .name = "badblocks"
+};
+
+/* lay out 'nspare' spares and their table on a device of 'total' blocks */
+static void bb_layout(struct bb_dev *bd, lba_t total, lba_t nspare)
+{
+    bd->nspare = nspare;
+    bd->ntable = (nspare * sizeof(struct bb_extent) + bd->bs - 1) / bd->bs;
+    if (bd->ntable == 0)
+        bd->ntable = 1;
+    bd->nblks = total - nspare - bd->ntable - 1;
+    bd->spare = bd->nblks;
+    bd->table_blk = bd->spare + nspare;
+}
+
+/* does header 'h' describe a table and spare area that fit on a device
+ * of 'total' blocks? Lays them out if so.
+ */
+static int bb_header_ok(struct bb_dev *bd, const struct bb_header *h, lba_t total)
+{
+    if (h->magic != BADBLOCKS_MAGIC || h->bs != (uint32_t)bd->bs || h->nspare < 1 ||
+        h->nspare >= total || h->used < 0 || h->used > h->nspare || h->count < 0 ||
+        h->count > h->used)
+        return 0;
+    bb_layout(bd, total, h->nspare);
+    return bd->nblks == h->nblks &&
+        (size_t)h->count * sizeof(struct bb_extent) <= (size_t)bd->ntable * bd->bs;
+}
+
+/* the table saved on the device in '*tp', if its header is there and
+ * makes sense, or NULL for a device to be given an empty one
+ */
+static int bb_load(struct bb_dev *bd, lba_t total, struct bb_table **tp)
+{
+    char *buf = malloc(bd->bs), *tbuf = NULL;
+    struct bb_table *t = NULL;
+    struct bb_header h;
+    int val = SUCCESS;
+
+    *tp = NULL;
+    if (buf == NULL)
+        return E_UNAVAIL;
+    if (bd->dev->ops->read(bd->dev, total - 1, 1, buf) == SUCCESS) {
+        memcpy(&h, buf, sizeof(h));
+        if (bb_header_ok(bd, &h, total)) {
+            tbuf = malloc((size_t)bd->ntable * bd->bs);
+            t = malloc(sizeof(*t) + h.count * sizeof(t->ext[0]));
+            if (tbuf == NULL || t == NULL) {
+                val = E_UNAVAIL;
+            } else if (bd->dev->ops->read(bd->dev, bd->table_blk, bd->ntable, tbuf) == SUCCESS) {
+                memcpy(t->ext, tbuf, h.count * sizeof(t->ext[0]));
+                t->count = h.count;
+                t->prev = NULL;
+                bd->used = h.used;
+                *tp = t;
+                t = NULL;
+            }
+        }
+    }
+    free(t);
+    free(tbuf);
+    free(buf);
+    return val;
+}
+
+/* create a bad block layer over 'dev', which it closes on close. A
+ * device that has one already keeps its table and spare area; otherwise
+ * 'nspare' spare blocks and their table are taken off the end.
+ */
+struct blkdev *badblocks_create(struct blkdev *dev, lba_t nspare)
+{
+    struct blkdev *bdev;
+    struct bb_dev *bd;
+    lba_t total;
+
+    if (dev == NULL || nspare < 1)
+        return NULL;
+
+    bdev = malloc(sizeof(*bdev));
+    bd = calloc(1, sizeof(*bd));
+    if (bdev == NULL || bd == NULL) {
+        free(bdev);
+        free(bd);
+        return NULL;
+    }
+
+    bd->magic = BADBLOCKS_DEV_MAGIC;
+    bd->dev = dev;
+    bd->bs = blkdev_block_size(dev);
+    total = dev->ops->num_blocks(dev);
+    if (bb_load(bd, total, &bd->table) != SUCCESS) {
+        free(bdev);
+        free(bd);
+        return NULL;
+    }
+    if (bd->table == NULL) {
+        bb_layout(bd, total, nspare);
+        if (bd->nblks < 1) {
+            fprintf(stderr, "badblocks: device of %lld blocks is too small\n", (long long)total);
+            free(bdev);
+            free(bd);
+            return NULL;
+        }
+        bd->table = calloc(1, sizeof(*bd->table));
+        if (bd->table == NULL) {
+            free(bdev);
+            free(bd);
+            return NULL;
+        }
+        if (bb_save(bd, bd->table, 0) != SUCCESS) {
+            fprintf(stderr, "badblocks: can't write the bad block table\n");
+            free(bd->table);
+            free(bdev);
+            free(bd);
+            return NULL;
+        }
+    }
+    pthread_mutex_init(&bd->lock, NULL);
+
+    bdev->private = bd;
+    bdev->ops = &badblocks_ops;
+    return bdev;
+}
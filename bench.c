@@ -0,0 +1,476 @@
+/*
+ * file:        bench.c
+ * description: fio-style workload generator for any blkdev stack
+ *
+ * Builds an image, mirror, raid0 or raid4 volume (optionally behind
+ * readahead), runs sequential/random read/write/mixed workloads from a
+ * number of threads at a given queue depth, and reports IOPS, MB/s and
+ * latency percentiles. Runs are repeatable for a given --seed; --stats
+ * adds the per-layer counters of every device in the stack.
+ *
+ *   bench --dev raid4 --disks 5 --unit 8 --rw randrw --rwmixread 70 \
+ *         --bs 4096 --iodepth 8 --numjobs 4 --runtime 10 --size 64M
+ *
+ * --block-size sets the logical block size of the member images (and so
+ * of the whole stack); --bs must be a multiple of it. --ramdisk builds
+ * the stack on ramdisks instead of image files, which leaves only the
+ * CPU cost of the layers; --hugepages puts them on huge pages.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "blkdev.h"
+
+#define MAX_DISKS 32
+
+/* latency histogram: log-linear buckets, 16 sub-buckets per power of
+ * two, so any percentile is within ~6% of the true value.
+ */
+#define LAT_SUB_BITS 4
+#define LAT_BUCKETS  (64 << LAT_SUB_BITS)
+
+struct lat_hist {
+    unsigned long count[LAT_BUCKETS];
+    unsigned long n;
+    unsigned long max;
+    double sum;
+};
+
+static int lat_bucket(unsigned long ns)
+{
+    int msb;
+    if (ns < (1UL << LAT_SUB_BITS))
+        return (int)ns;
+    msb = 63 - __builtin_clzl(ns);
+    return ((msb - LAT_SUB_BITS + 1) << LAT_SUB_BITS) +
+        (int)((ns >> (msb - LAT_SUB_BITS)) & ((1 << LAT_SUB_BITS) - 1));
+}
+
+/* upper bound of a bucket's range */
+static unsigned long lat_bucket_value(int b)
+{
+    int shift;
+    if (b < (1 << LAT_SUB_BITS))
+        return b;
+    shift = (b >> LAT_SUB_BITS) - 1;
+    return (((unsigned long)(b & ((1 << LAT_SUB_BITS) - 1)) | (1UL << LAT_SUB_BITS))
+            << shift) + (1UL << shift) - 1;
+}
+
+static void lat_add(struct lat_hist *h, unsigned long ns)
+{
+    h->count[lat_bucket(ns)]++;
+    h->n++;
+    h->sum += ns;
+    if (ns > h->max)
+        h->max = ns;
+}
+
+static void lat_merge(struct lat_hist *dst, struct lat_hist *src)
+{
+    int i;
+    for (i = 0; i < LAT_BUCKETS; i++)
+        dst->count[i] += src->count[i];
+    dst->n += src->n;
+    dst->sum += src->sum;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+static unsigned long lat_percentile(struct lat_hist *h, double pct)
+{
+    unsigned long want = (unsigned long)(h->n * pct / 100.0 + 0.5), seen = 0;
+    int i;
+    if (want == 0)
+        want = 1;
+    for (i = 0; i < LAT_BUCKETS; i++) {
+        seen += h->count[i];
+        if (seen >= want)
+            return lat_bucket_value(i) < h->max ? lat_bucket_value(i) : h->max;
+    }
+    return h->max;
+}
+
+enum {RW_READ, RW_WRITE, RW_RANDREAD, RW_RANDWRITE, RW_RW, RW_RANDRW};
+
+static const char *rw_names[] = {
+    "read", "write", "randread", "randwrite", "rw", "randrw"
+};
+
+struct options {
+    const char *dev;
+    int disks;
+    int unit;
+    long disk_size;             /* bytes per member image */
+    int block_size;             /* logical block size, bytes */
+    int readahead;
+    int rw;
+    int rwmixread;
+    int bs;                     /* bytes */
+    int iodepth;
+    int numjobs;
+    double runtime;
+    long size;                  /* bytes, 0 = whole volume */
+    unsigned seed;
+    int hw_queues;
+    int stats;
+    int ramdisk;                /* members in memory; RAMDISK_xxx flags + 1 */
+};
+
+struct job {
+    struct options *opt;
+    struct blkdev *dev;
+    struct blk_mq *mq;
+    int id;
+    long first, nblks;          /* this job's area, in blocks */
+    long next;                  /* sequential cursor */
+    unsigned seed;
+    struct lat_hist lat[2];     /* read, write */
+    unsigned long blocks[2];
+    int errors;
+};
+
+static unsigned long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* choose the next operation and address for a job */
+static void job_next(struct job *j, int *op, long *blk)
+{
+    struct options *opt = j->opt;
+    long bs = opt->bs / opt->block_size;
+    long slots = j->nblks / bs;
+    int random = opt->rw == RW_RANDREAD || opt->rw == RW_RANDWRITE || opt->rw == RW_RANDRW;
+
+    switch (opt->rw) {
+    case RW_READ: case RW_RANDREAD:
+        *op = BLK_MQ_READ;
+        break;
+    case RW_WRITE: case RW_RANDWRITE:
+        *op = BLK_MQ_WRITE;
+        break;
+    default:
+        *op = (int)(rand_r(&j->seed) % 100) < opt->rwmixread ? BLK_MQ_READ : BLK_MQ_WRITE;
+    }
+
+    if (random) {
+        long r = ((long)rand_r(&j->seed) << 31) ^ rand_r(&j->seed);
+        *blk = j->first + (r % slots) * bs;
+    } else {
+        *blk = j->first + j->next;
+        j->next += bs;
+        if (j->next + bs > j->nblks)
+            j->next = 0;
+    }
+}
+
+static void job_account(struct job *j, int op, int result, unsigned long ns)
+{
+    if (result != SUCCESS) {
+        j->errors++;
+        return;
+    }
+    lat_add(&j->lat[op], ns);
+    j->blocks[op] += j->opt->bs / j->opt->block_size;
+}
+
+/* queue depth 1 - call the device directly */
+static void run_sync(struct job *j, char *buf, unsigned long deadline)
+{
+    int op, val;
+    long blk, bs = j->opt->bs / j->opt->block_size;
+    unsigned long t0;
+
+    while ((t0 = now_ns()) < deadline) {
+        job_next(j, &op, &blk);
+        if (op == BLK_MQ_READ)
+            val = blkdev_read(j->dev, blk, bs, buf);
+        else
+            val = blkdev_write(j->dev, blk, bs, buf);
+        job_account(j, op, val, now_ns() - t0);
+    }
+}
+
+/* queue depth > 1 - keep iodepth requests in flight through blk_mq on
+ * this job's own software context.
+ */
+static void run_queued(struct job *j, char *bufs, unsigned long deadline)
+{
+    int qd = j->opt->iodepth, inflight = 0, i, n, op;
+    long blk, bs = j->opt->bs / j->opt->block_size;
+    struct blk_mq_req *rqs = calloc(qd, sizeof(*rqs));
+    struct blk_mq_req **done = calloc(qd, sizeof(*done));
+    unsigned long *start = calloc(qd, sizeof(*start));
+    unsigned long t;
+
+    for (i = 0; i < qd; i++) {
+        rqs[i].buf = bufs + (size_t)i * j->opt->bs;
+        job_next(j, &op, &blk);
+        rqs[i].op = op;
+        rqs[i].first_blk = blk;
+        rqs[i].num_blks = bs;
+        start[i] = now_ns();
+        blk_mq_submit(j->mq, j->id, &rqs[i]);
+        inflight++;
+    }
+    while (inflight > 0) {
+        n = blk_mq_reap(j->mq, j->id, done, 1, qd);
+        t = now_ns();
+        for (i = 0; i < n; i++) {
+            int k = done[i] - rqs;
+            job_account(j, done[i]->op, done[i]->result, t - start[k]);
+            inflight--;
+            if (t < deadline) {
+                job_next(j, &op, &blk);
+                done[i]->op = op;
+                done[i]->first_blk = blk;
+                done[i]->num_blks = bs;
+                start[k] = now_ns();
+                blk_mq_submit(j->mq, j->id, done[i]);
+                inflight++;
+            }
+        }
+    }
+    free(rqs);
+    free(done);
+    free(start);
+}
+
+static void *job_thread(void *arg)
+{
+    struct job *j = arg;
+    int qd = j->opt->iodepth;
+    char *bufs = malloc((size_t)qd * j->opt->bs);
+    unsigned long deadline;
+    size_t i;
+
+    for (i = 0; i < (size_t)qd * j->opt->bs; i++)
+        bufs[i] = (char)(i * 7 + j->id);
+    deadline = now_ns() + (unsigned long)(j->opt->runtime * 1e9);
+    if (qd == 1)
+        run_sync(j, bufs, deadline);
+    else
+        run_queued(j, bufs, deadline);
+    free(bufs);
+    return NULL;
+}
+
+/* create a zero-filled sparse image file, or a ramdisk */
+static struct blkdev *bench_image(int i, long bytes, int block_size, int ramdisk)
+{
+    char path[64];
+    FILE *fp;
+    if (ramdisk)
+        return ramdisk_create_bs(bytes / block_size, block_size, ramdisk - 1);
+    sprintf(path, "bench-disk%d", i);
+    if ((fp = fopen(path, "w")) == NULL) {
+        perror(path);
+        return NULL;
+    }
+    fseek(fp, bytes / block_size * block_size - 1, SEEK_SET);
+    fputc(0, fp);
+    fclose(fp);
+    return image_create_bs(path, block_size);
+}
+
+static struct blkdev *bench_stack(struct options *opt, int *data_disks)
+{
+    struct blkdev *disks[MAX_DISKS], *dev = NULL;
+    int i, n = opt->disks;
+
+    if (!strcmp(opt->dev, "image"))
+        n = opt->disks = 1;
+    else if (!strcmp(opt->dev, "mirror"))
+        n = opt->disks = 2;
+    for (i = 0; i < n; i++)
+        if ((disks[i] = bench_image(i, opt->disk_size, opt->block_size, opt->ramdisk)) == NULL)
+            return NULL;
+
+    *data_disks = 1;
+    if (!strcmp(opt->dev, "image"))
+        dev = disks[0];
+    else if (!strcmp(opt->dev, "mirror"))
+        dev = mirror_create(disks);
+    else if (!strcmp(opt->dev, "raid0")) {
+        dev = raid0_create(n, disks, opt->unit);
+        *data_disks = n;
+    } else if (!strcmp(opt->dev, "raid4")) {
+        dev = raid4_create(n, disks, opt->unit);
+        *data_disks = n - 1;
+    } else
+        fprintf(stderr, "unknown device type %s\n", opt->dev);
+
+    if (dev != NULL && opt->readahead)
+        dev = readahead_create(dev, opt->unit * *data_disks, 16 * opt->unit * *data_disks);
+    return dev;
+}
+
+static long parse_size(const char *s)
+{
+    char *end;
+    long v = strtol(s, &end, 0);
+    switch (*end) {
+    case 'k': case 'K': return v << 10;
+    case 'm': case 'M': return v << 20;
+    case 'g': case 'G': return v << 30;
+    }
+    return v;
+}
+
+static void report(const char *name, struct lat_hist *h, unsigned long blocks,
+                   int block_size, double secs)
+{
+    if (h->n == 0)
+        return;
+    printf("  %-5s: IOPS=%.0f, BW=%.2f MB/s, lat(usec) avg=%.1f p50=%.1f p90=%.1f "
+           "p99=%.1f p99.9=%.1f max=%.1f\n", name, h->n / secs,
+           blocks * (double)block_size / secs / 1e6, h->sum / h->n / 1e3,
+           lat_percentile(h, 50) / 1e3, lat_percentile(h, 90) / 1e3,
+           lat_percentile(h, 99) / 1e3, lat_percentile(h, 99.9) / 1e3, h->max / 1e3);
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: bench [--dev image|mirror|raid0|raid4] [--disks N] [--unit BLKS]\n"
+            "             [--disk-size BYTES] [--readahead] [--rw read|write|randread|\n"
+            "             randwrite|rw|randrw] [--rwmixread PCT] [--bs BYTES]\n"
+            "             [--iodepth N] [--numjobs N] [--runtime SECS] [--size BYTES]\n"
+            "             [--hw-queues N] [--seed N] [--block-size BYTES] [--stats]\n"
+            "             [--ramdisk] [--hugepages]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct options opt = {"raid0", 4, 8, 32 << 20, BLOCK_SIZE, 0, RW_RANDREAD, 50, 4096, 1, 1,
+                          5.0, 0, 1, 0, 0, 0};
+    static struct option longopts[] = {
+        {"dev", 1, 0, 'd'}, {"disks", 1, 0, 'n'}, {"unit", 1, 0, 'u'},
+        {"disk-size", 1, 0, 'D'}, {"readahead", 0, 0, 'a'}, {"rw", 1, 0, 'w'},
+        {"rwmixread", 1, 0, 'm'}, {"bs", 1, 0, 'b'}, {"iodepth", 1, 0, 'q'},
+        {"numjobs", 1, 0, 'j'}, {"runtime", 1, 0, 't'}, {"size", 1, 0, 's'},
+        {"hw-queues", 1, 0, 'H'}, {"seed", 1, 0, 'S'}, {"stats", 0, 0, 'x'},
+        {"block-size", 1, 0, 'B'}, {"ramdisk", 0, 0, 'r'}, {"hugepages", 0, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    struct lat_hist total[2];
+    unsigned long blocks[2] = {0, 0};
+    struct blkdev *dev;
+    struct blk_mq *mq = NULL;
+    struct job *jobs;
+    pthread_t *threads;
+    int c, i, data_disks, errors = 0;
+    long nblks, bs_blks;
+    unsigned long t0;
+    double secs;
+
+    while ((c = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (c) {
+        case 'd': opt.dev = optarg; break;
+        case 'n': opt.disks = atoi(optarg); break;
+        case 'u': opt.unit = atoi(optarg); break;
+        case 'D': opt.disk_size = parse_size(optarg); break;
+        case 'B': opt.block_size = (int)parse_size(optarg); break;
+        case 'a': opt.readahead = 1; break;
+        case 'w':
+            for (opt.rw = 0; opt.rw < 6; opt.rw++)
+                if (!strcmp(optarg, rw_names[opt.rw]))
+                    break;
+            if (opt.rw == 6)
+                usage();
+            break;
+        case 'm': opt.rwmixread = atoi(optarg); break;
+        case 'b': opt.bs = (int)parse_size(optarg); break;
+        case 'q': opt.iodepth = atoi(optarg); break;
+        case 'j': opt.numjobs = atoi(optarg); break;
+        case 't': opt.runtime = atof(optarg); break;
+        case 's': opt.size = parse_size(optarg); break;
+        case 'H': opt.hw_queues = atoi(optarg); break;
+        case 'S': opt.seed = strtoul(optarg, NULL, 0); break;
+        case 'x': opt.stats = 1; break;
+        case 'r': opt.ramdisk = opt.ramdisk ? opt.ramdisk : 1; break;
+        case 'h': opt.ramdisk = RAMDISK_HUGEPAGES + 1; break;
+        default: usage();
+        }
+    }
+    if (opt.block_size < BLOCK_SIZE || opt.bs < opt.block_size ||
+        opt.bs % opt.block_size || opt.iodepth < 1 ||
+        opt.numjobs < 1 || opt.disks < 1 || opt.disks > MAX_DISKS || opt.unit < 1)
+        usage();
+
+    if ((dev = bench_stack(&opt, &data_disks)) == NULL)
+        return 1;
+    nblks = blkdev_num_blocks(dev);
+    if (opt.size > 0 && opt.size / opt.block_size < nblks)
+        nblks = opt.size / opt.block_size;
+    bs_blks = opt.bs / opt.block_size;
+    if (nblks / opt.numjobs < bs_blks) {
+        fprintf(stderr, "working set too small for %d jobs of %d bytes\n", opt.numjobs, opt.bs);
+        return 1;
+    }
+
+    if (opt.iodepth > 1)
+        mq = blk_mq_create(dev, opt.numjobs, opt.hw_queues ? opt.hw_queues : data_disks, opt.unit);
+
+    jobs = calloc(opt.numjobs, sizeof(*jobs));
+    threads = calloc(opt.numjobs, sizeof(*threads));
+    for (i = 0; i < opt.numjobs; i++) {
+        jobs[i].opt = &opt;
+        jobs[i].dev = dev;
+        jobs[i].mq = mq;
+        jobs[i].id = i;
+        jobs[i].seed = opt.seed * 7919 + i;
+        /* random jobs share the working set, sequential ones split it */
+        if (opt.rw == RW_READ || opt.rw == RW_WRITE || opt.rw == RW_RW) {
+            jobs[i].nblks = nblks / opt.numjobs / bs_blks * bs_blks;
+            jobs[i].first = i * jobs[i].nblks;
+        } else
+            jobs[i].nblks = nblks / bs_blks * bs_blks;
+    }
+
+    t0 = now_ns();
+    for (i = 0; i < opt.numjobs; i++)
+        pthread_create(&threads[i], NULL, job_thread, &jobs[i]);
+    for (i = 0; i < opt.numjobs; i++)
+        pthread_join(threads[i], NULL);
+    secs = (now_ns() - t0) / 1e9;
+
+    memset(total, 0, sizeof(total));
+    for (i = 0; i < opt.numjobs; i++) {
+        lat_merge(&total[0], &jobs[i].lat[0]);
+        lat_merge(&total[1], &jobs[i].lat[1]);
+        blocks[0] += jobs[i].blocks[0];
+        blocks[1] += jobs[i].blocks[1];
+        errors += jobs[i].errors;
+    }
+
+    printf("%s%s disks=%d unit=%d block=%d: rw=%s bs=%d iodepth=%d numjobs=%d size=%ld "
+           "runtime=%.2fs\n", opt.readahead ? "readahead+" : "", opt.dev, opt.disks, opt.unit,
+           opt.block_size, rw_names[opt.rw], opt.bs, opt.iodepth, opt.numjobs,
+           nblks * (long)opt.block_size, secs);
+    report("read", &total[0], blocks[0], opt.block_size, secs);
+    report("write", &total[1], blocks[1], opt.block_size, secs);
+    if (errors)
+        printf("  errors: %d\n", errors);
+    if (opt.stats)
+        blkdev_dump_stats(dev, stdout);
+
+    if (mq != NULL)
+        blk_mq_destroy(mq);
+    blkdev_close(dev);
+    free(jobs);
+    free(threads);
+    return errors ? 1 : 0;
+}
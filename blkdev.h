@@ -8,7 +8,56 @@
 #ifndef __BLKDEV_H__
 #define __BLKDEV_H__
 
-#define BLOCK_SIZE 512   /* 512-byte unit for all blkdev addressing in HW3 */
+#define BLOCK_SIZE 512   /* default logical block size, see blkdev_block_size() */
+#define BLOCK_SIZE_MAX 65536
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* Block addresses and block counts. 64 bits, so multi-terabyte members
+ * and their byte offsets never overflow.
+ */
+typedef int64_t lba_t;
+
+/* Per-device I/O statistics. Latency bucket b counts operations that
+ * took [2^b, 2^(b+1)) nanoseconds.
+ */
+#define BLKDEV_LAT_BUCKETS 40
+
+enum {BLKDEV_OP_READ, BLKDEV_OP_WRITE, BLKDEV_OP_DISCARD, BLKDEV_OP_WRITE_ZEROES,
+      BLKDEV_OP_FLUSH, BLKDEV_NR_OPS};
+
+/* write flags */
+#define BLKDEV_FUA 1    /* the data is durable when the write returns */
+
+/* extent types returned by map_extent */
+enum {BLKDEV_EXTENT_HOLE, BLKDEV_EXTENT_DATA};
+
+struct blkdev_op_stats {
+    unsigned long ops;
+    unsigned long blocks;
+    unsigned long errors;
+    unsigned long total_ns;
+    unsigned long lat[BLKDEV_LAT_BUCKETS];
+};
+
+struct blkdev_stats {
+    struct blkdev_op_stats op[BLKDEV_NR_OPS];
+    unsigned long degraded_reads;       /* blocks read with a member missing */
+    unsigned long rmw_writes;           /* blocks written by read-modify-write */
+    unsigned long full_stripe_writes;   /* stripe rows written without reads */
+    unsigned long rebuilt;              /* blocks copied or reconstructed by replace */
+    unsigned long rebuild_skipped;      /* blocks replace skipped as discarded */
+    unsigned long hedged_reads;         /* reads also sent elsewhere for being slow */
+    unsigned long hedge_wins;           /* ... that the second read answered */
+    unsigned long throttled_ns;         /* background I/O held back for foreground */
+    unsigned long scrubbed;             /* member blocks checked by scrub */
+    unsigned long scrub_mismatches;     /* ... that were inconsistent */
+    unsigned long csum_errors;          /* blocks that failed their checksum */
+    unsigned long read_repairs;         /* member blocks rewritten after a bad read */
+    unsigned long remapped;             /* blocks moved to spares after a failed write */
+};
 
 /* A device 'interface' that all RAID implementations will use. An implementation will assign
  * functions to the fields of 'ops', and assign an implementation-specific object to 'private'.
@@ -20,24 +69,75 @@ struct blkdev {
 
 struct blkdev_ops {
     /* Returns the total number of blocks in the device */
-    int  (*num_blocks)(struct blkdev *dev);
+    lba_t (*num_blocks)(struct blkdev *dev);
 
     /* Similar to read() of a file descriptor, but reads from a device.
      *   first_blk: first block number to read
      *   num_blks: number of blocks to read
      *   buf: destination buffer to put read bytes
      */
-    int  (*read)(struct blkdev * dev, int first_blk, int num_blks, void *buf);
+    int  (*read)(struct blkdev * dev, lba_t first_blk, lba_t num_blks, void *buf);
 
     /* Similar to write() of a file descriptor, but writes to a device.
      *   first_blk: first block number to write
      *   num_blks: number of blocks to write
      *   buf: source buffer where data will come from
      */
-    int  (*write)(struct blkdev * dev, int first_blk, int num_blks, void *buf);
+    int  (*write)(struct blkdev * dev, lba_t first_blk, lba_t num_blks, void *buf);
 
     /* Close a device */
     void (*close)(struct blkdev *dev);
+
+    /* Optional: the device's statistics, updated as I/O completes */
+    struct blkdev_stats *(*stats)(struct blkdev *dev);
+
+    /* Optional: store up to 'max' member devices in 'out', return the count */
+    int  (*members)(struct blkdev *dev, struct blkdev **out, int max);
+
+    /* Optional: logical block size in bytes; BLOCK_SIZE if not set.
+     * Block numbers, counts and buffers passed to read and write are in
+     * units of this size.
+     */
+    int  (*block_size)(struct blkdev *dev);
+
+    /* Optional: the blocks no longer hold data anyone needs. Their
+     * contents are unspecified until written again (image files read
+     * back zeros); RAID layers remember discarded regions and don't
+     * rebuild them.
+     */
+    int  (*discard)(struct blkdev *dev, lba_t first_blk, lba_t num_blks);
+
+    /* Optional: make the blocks read back as zeros, ideally without
+     * sending any zeros to the device
+     */
+    int  (*write_zeroes)(struct blkdev *dev, lba_t first_blk, lba_t num_blks);
+
+    /* Optional: make every write that has completed durable. Devices
+     * without a volatile cache leave it unset.
+     */
+    int  (*flush)(struct blkdev *dev);
+
+    /* Optional: write with BLKDEV_xxx flags; without it BLKDEV_FUA is a
+     * write followed by a flush
+     */
+    int  (*write_flags)(struct blkdev *dev, lba_t first_blk, lba_t num_blks, void *buf,
+                        int flags);
+
+    /* Optional: report whether 'first_blk' starts a hole (unallocated,
+     * reads as zeros) or data, and set *len to how many of the next
+     * 'num_blks' blocks are the same. Without it everything is data.
+     */
+    int  (*map_extent)(struct blkdev *dev, lba_t first_blk, lba_t num_blks, lba_t *len);
+
+    /* Optional: copy 'num_blks' blocks from 'src' (any device with the
+     * same block size) into this one without a round trip through the
+     * caller's memory where possible.
+     */
+    int  (*copy_range)(struct blkdev *dev, lba_t first_blk, struct blkdev *src, lba_t src_blk,
+                       lba_t num_blks);
+
+    /* Device type, for reports */
+    const char *name;
 };
 
 /* Constants that are returned by the blkdev_ops functions.
@@ -46,39 +146,314 @@ struct blkdev_ops {
  *     maximum block in the device
  *   E_UNAVAIL - if the device could not be read or written. This error means the device has failed.
  *   E_SIZE - an image is not large enough to be used in the RAID device.
+ *   E_CORRUPT - the data read back didn't match its checksum. The device is still there;
+ *     a RAID layer above it reads the blocks from elsewhere and rewrites them.
  */
-enum {SUCCESS = 0, E_BADADDR = -1, E_UNAVAIL = -2, E_SIZE = -3};
+enum {SUCCESS = 0, E_BADADDR = -1, E_UNAVAIL = -2, E_SIZE = -3, E_CORRUPT = -4};
 
 /* Create a 'raw' image from a given file */
 extern struct blkdev *image_create(char *path);
+/* Create an image with a logical block size of 'block_size' bytes (a
+ * power of two from BLOCK_SIZE to BLOCK_SIZE_MAX, e.g. 4096)
+ */
+extern struct blkdev *image_create_bs(char *path, int block_size);
 /* Cause the image to be in a failed state */
 extern void image_fail(struct blkdev *);
 
-/* Create a mirror RAID device out of the given blkdev array */
+/* Create a zero-filled in-memory device of 'nblocks' BLOCK_SIZE blocks */
+extern struct blkdev *ramdisk_create(lba_t nblocks);
+/* ... of 'block_size'-byte blocks, with RAMDISK_xxx flags */
+#define RAMDISK_HUGEPAGES 1     /* back it with huge pages where available */
+extern struct blkdev *ramdisk_create_bs(lba_t nblocks, int block_size, int flags);
+/* Cause the ramdisk to be in a failed state */
+extern void ramdisk_fail(struct blkdev *);
+
+/* Create a mirror RAID device out of the given blkdev array; one side
+ * may be NULL, to reassemble it degraded */
 extern struct blkdev *mirror_create(struct blkdev *[2]);
 /* Replace a device in a mirror */
 extern int mirror_replace(struct blkdev *, int, struct blkdev *);
+/* Hedge mirror reads: a read the first side hasn't answered within
+ * 'budget_ns' is sent to the other side too, and the first answer wins.
+ * 0 turns hedging off; MIRROR_HEDGE_P95 uses the first side's 95th
+ * percentile read latency so far.
+ */
+#define MIRROR_HEDGE_P95 (-1L)
+extern void mirror_set_hedge(struct blkdev *, long budget_ns);
 
 /* Create a raid0 device */
 extern struct blkdev *raid0_create(int, struct blkdev **, int);
 
-/* Create a raid4 device */
+/* Create a raid4 device; one disk may be NULL, to reassemble it
+ * degraded */
 extern struct blkdev *raid4_create(int, struct blkdev **, int);
 
 /* Replace a disk in a raid4 device */
 extern int raid4_replace(struct blkdev *, int, struct blkdev *);
+/* Read around slow raid4 members: a strip read its member hasn't answered
+ * within 'deadline_ns' is also reconstructed from the other members and
+ * parity, and the first answer wins (RAID4_DEADLINE_P95: the member's
+ * 95th percentile read latency so far); a member with 'max_queue' or
+ * more reads in flight is reconstructed around without trying it. 0
+ * turns either off. Both need every member up.
+ */
+#define RAID4_DEADLINE_P95 (-1L)
+extern void raid4_set_slow_member(struct blkdev *, long deadline_ns, int max_queue);
+
+/* Slow member policy for mirror, raid0 and raid4 arrays. Member reads
+ * are timed, and a member whose average read latency stays over
+ * 'factor' times the median of its peers' (and over 'min_ns') for
+ * 'strikes' checks in a row is slow. What happens then is 'action':
+ *   RAID_SLOW_WARN  - nothing but the event;
+ *   RAID_SLOW_AVOID - reads go around it (to the other side of a mirror,
+ *                     or reconstructed from raid4 parity), bar a few that
+ *                     show whether it has recovered;
+ *   RAID_SLOW_EJECT - it is failed as if it had returned E_UNAVAIL, if
+ *                     the array can do without it.
+ * raid0 can't do without any member, so it only warns. 'event', if set,
+ * is called with a RAID_EVENT_xxx on every change, along with the
+ * member's average and its peers', in ns.
+ */
+enum {RAID_SLOW_WARN, RAID_SLOW_AVOID, RAID_SLOW_EJECT};
+enum {RAID_EVENT_SLOW, RAID_EVENT_RECOVERED, RAID_EVENT_EJECTED};
+
+struct raid_slow_policy {
+    int action;                 /* RAID_SLOW_xxx */
+    double factor;              /* 0 for the default, 4 */
+    unsigned long min_ns;
+    int strikes;                /* 0 for the default, 3 */
+    void (*event)(void *arg, struct blkdev *volume, int member, int event,
+                  unsigned long member_ns, unsigned long peer_ns);
+    void *arg;
+};
+
+/* Set the slow member policy of an array; NULL turns tracking off */
+extern int raid_set_slow_policy(struct blkdev *volume, const struct raid_slow_policy *);
+
+/* I/O priority classes. Foreground I/O - everything through the blkdev
+ * ops - is never held back. Rebuild (replace) and scrub run next to it
+ * at a bandwidth between 'min_bw' and 'max_bw' bytes/s (0: no limit),
+ * backing off while the array's mean foreground latency is over
+ * 'target_ns' (0: never) and speeding up again once it isn't. Scrub
+ * also waits for any rebuild to finish.
+ */
+enum {RAID_PRIO_FOREGROUND, RAID_PRIO_REBUILD, RAID_PRIO_SCRUB, RAID_NR_PRIO};
+
+struct raid_throttle {
+    double min_bw;
+    double max_bw;
+    unsigned long target_ns;
+};
+
+/* Set the throttle of a background class on a mirror or raid4 array */
+extern int raid_set_throttle(struct blkdev *volume, int prio, const struct raid_throttle *);
+
+/* Scrub a mirror or raid4 array: read every member in large chunks and
+ * check that the two sides of the mirror agree, or that parity matches
+ * the data. Positions are member blocks - a mirror's blocks, or a raid4
+ * member offset. The scrub starts at 'next' (rounded down to a region)
+ * and stops at 'end' (0: the end) or when 'stop' is set, leaving 'next'
+ * where it got to, so a scrub saved by 'checkpoint' can be resumed.
+ * With RAID_SCRUB_REPAIR, raid4 parity is rewritten from the data and a
+ * mirror's second side from its first. It runs as RAID_PRIO_SCRUB, so
+ * raid_set_throttle limits it. Returns E_UNAVAIL if the array is
+ * degraded, since there is nothing to check against.
+ */
+#define RAID_SCRUB_REPAIR 1
+
+struct raid_scrub {
+    lba_t next;
+    lba_t end;
+    int flags;                  /* RAID_SCRUB_xxx */
+    volatile int stop;
+    /* optional: where a later scrub may resume, called now and then */
+    void (*checkpoint)(void *arg, lba_t next);
+    /* optional: for every inconsistent range */
+    void (*mismatch)(void *arg, lba_t first, lba_t num_blks, int repaired);
+    void *arg;
+    lba_t checked;              /* member blocks; these count up */
+    lba_t mismatched;
+    lba_t repaired;
+};
+
+extern int raid_scrub(struct blkdev *volume, struct raid_scrub *);
+
+/* Give a mirror or raid4 array a hot spare, which it then owns. When a
+ * member fails, the array rebuilds onto the first spare in the
+ * background as replace would - at RAID_PRIO_REBUILD, so
+ * raid_set_throttle limits it - and carries on from the next spare if
+ * that one fails too. Returns E_SIZE if the spare couldn't replace a
+ * member, or E_UNAVAIL (and the spare is still the caller's) if there's
+ * no memory to take it. Closing the array stops a rebuild in progress and closes the
+ * unused spares.
+ */
+extern int raid_add_spare(struct blkdev *volume, struct blkdev *spare);
+/* Wait until no rebuild onto a spare is running or about to start, and
+ * return how many spares are left.
+ */
+extern int raid_wait_spares(struct blkdev *volume);
+
+/* Checkpoint replace (and spare rebuilds) every 'interval' member
+ * blocks on a mirror or raid4 array; 0, the default, turns it off. The
+ * checkpoint is a record in the new member's last block, which stays
+ * true while the array runs and goes once the member is in service.
+ * Closing the array stops a rebuild in progress, checkpointing it
+ * first. To carry on after a restart, reassemble the array with the
+ * member missing (NULL) and give the new member back with
+ * raid_add_spare before writing to the array: the rebuild resumes from
+ * the checkpoint rather than the start.
+ */
+extern int raid_set_rebuild_checkpoint(struct blkdev *volume, lba_t interval);
+
+/* Create a readahead layer over a device, with prefetch windows aligned
+ * to (and a multiple of) 'align' blocks and growing up to 'max_window'
+ */
+extern struct blkdev *readahead_create(struct blkdev *, lba_t align, lba_t max_window);
+
+/* Put a checksumming layer in front of 'dev': a CRC32C of every block
+ * is kept at the end of 'dev' and checked on every read, which fails
+ * with E_CORRUPT on a mismatch. 'dev' is formatted if it has no
+ * checksums yet, keeping what it holds.
+ */
+extern struct blkdev *integrity_create(struct blkdev *dev);
+/* CRC32C (Castagnoli) of 'len' bytes, carrying on from 'crc' (0 to start) */
+extern uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* Put a bad block layer in front of 'dev': a write that fails moves
+ * the blocks it can't write to spare blocks at the end of 'dev'
+ * ('nspare' of them, unless 'dev' has a bad block table already), and
+ * only fails once the spares are used up. The table is kept on 'dev'.
+ */
+extern struct blkdev *badblocks_create(struct blkdev *dev, lba_t nspare);
+
+/* Simulated device behaviour, for sim_create. Times are nanoseconds;
+ * zero turns a feature off.
+ */
+enum {SIM_LAT_FIXED, SIM_LAT_UNIFORM, SIM_LAT_EXP, SIM_LAT_PARETO};
+
+struct sim_params {
+    int lat_dist;               /* SIM_LAT_xxx */
+    unsigned long lat_ns;       /* the fixed value, uniform maximum, exponential
+                                 * mean, or pareto minimum */
+    double pareto_alpha;        /* pareto shape; smaller is a heavier tail */
+    double spike_prob;          /* chance of an extra spike_ns on an op */
+    unsigned long spike_ns;
+    double bandwidth;           /* bytes per second */
+    int qdepth;                 /* ops in service at once; more wait */
+    double error_prob;          /* chance an op fails with E_UNAVAIL */
+    unsigned long seek_ns;      /* any head movement */
+    unsigned long seek_full_ns; /* plus this, scaled by sqrt(distance / size) */
+    uint64_t seed;
+    lba_t bad_first;            /* reads and writes touching these blocks */
+    lba_t bad_blocks;           /* ... always fail, like a bad patch of media */
+};
+
+/* Put a simulated device in front of 'dev' (which does the actual I/O) */
+extern struct blkdev *sim_create(struct blkdev *dev, const struct sim_params *p);
+/* Change a simulated device's parameters; the random sequence carries on */
+extern void sim_configure(struct blkdev *dev, const struct sim_params *p);
     
+/* Multi-queue submission into a blkdev that is safe for concurrent use.
+ * Fill in op, first_blk, num_blks, buf (and optionally end_io/private),
+ * submit on the caller's software context, and either reap the request
+ * from that context or get called back from the hardware context.
+ */
+enum {BLK_MQ_READ, BLK_MQ_WRITE, BLK_MQ_DISCARD, BLK_MQ_WRITE_ZEROES, BLK_MQ_FLUSH,
+      BLK_MQ_WRITE_FUA};
+
+struct blk_mq_req {
+    int   op;
+    lba_t first_blk;
+    lba_t num_blks;
+    void *buf;
+    int   result;                           /* SUCCESS or E_xxx when complete */
+    void (*end_io)(struct blk_mq_req *);    /* optional completion callback */
+    void *private;
+    int   ctx;                              /* used by blk_mq */
+    struct blk_mq_req *next;
+};
+
+struct blk_mq;
+
+/* 'nr_ctx' software contexts, 'nr_hw' hardware contexts; a request goes
+ * to hardware context (first_blk / map_unit) % nr_hw
+ */
+extern struct blk_mq *blk_mq_create(struct blkdev *, int nr_ctx, int nr_hw, lba_t map_unit);
+extern int blk_mq_ctx_id(struct blk_mq *);
+extern int blk_mq_submit(struct blk_mq *, int ctx, struct blk_mq_req *);
+extern int blk_mq_reap(struct blk_mq *, int ctx, struct blk_mq_req **done, int min, int max);
+extern void blk_mq_destroy(struct blk_mq *);
+
 /* The following operations should be used to operate on any blkdev device, whether
  * it be a raw image or one of the RAID devices (mirror, raid0, raid4).
  */
 
 /* Write to a blkdev device */
-extern int blkdev_read(struct blkdev * dev, int first_blk, int num_blks, void *buf);
+extern int blkdev_read(struct blkdev * dev, lba_t first_blk, lba_t num_blks, void *buf);
 /* Read from a blkdev device */
-extern int blkdev_write(struct blkdev * dev, int first_blk, int num_blks, void *buf);
+extern int blkdev_write(struct blkdev * dev, lba_t first_blk, lba_t num_blks, void *buf);
 /* Number of blocks in a blkdev device */
-extern int blkdev_num_blocks(struct blkdev * dev);
+extern lba_t blkdev_num_blocks(struct blkdev * dev);
+/* Logical block size of a blkdev device, in bytes */
+extern int blkdev_block_size(struct blkdev * dev);
+/* Discard blocks of a blkdev device; a no-op for devices that can't */
+extern int blkdev_discard(struct blkdev * dev, lba_t first_blk, lba_t num_blks);
+/* Zero blocks of a blkdev device; writes zeros if it has no write_zeroes */
+extern int blkdev_write_zeroes(struct blkdev * dev, lba_t first_blk, lba_t num_blks);
+/* Make completed writes to a blkdev device durable */
+extern int blkdev_flush(struct blkdev * dev);
+/* Write to a blkdev device with BLKDEV_xxx flags */
+extern int blkdev_write_flags(struct blkdev * dev, lba_t first_blk, lba_t num_blks, void *buf,
+                              int flags);
+/* BLKDEV_EXTENT_HOLE or _DATA for the extent at 'first_blk', its length in *len */
+extern int blkdev_map_extent(struct blkdev * dev, lba_t first_blk, lba_t num_blks, lba_t *len);
+/* Copy blocks of 'src' to 'dev'; reads and writes if 'dev' has no copy_range */
+extern int blkdev_copy_range(struct blkdev * dev, lba_t first_blk, struct blkdev * src,
+                             lba_t src_blk, lba_t num_blks);
 /* Close a blkdev device */
 extern void blkdev_close(struct blkdev * dev);
+/* Copy a device's statistics into 'st'; E_UNAVAIL if it keeps none */
+extern int blkdev_get_stats(struct blkdev *dev, struct blkdev_stats *st);
+/* Print statistics for a device and, indented, everything below it */
+extern void blkdev_dump_stats(struct blkdev *dev, FILE *fp);
+
+/* Helpers for blkdev implementations: take a timestamp before an
+ * operation, then account it (op, size, result, latency) when it ends.
+ */
+extern unsigned long blkdev_stats_start(void);
+extern void blkdev_stats_end(struct blkdev_stats *st, int op, lba_t num_blks, int result,
+                             unsigned long start);
+extern void blkdev_stats_add(unsigned long *counter, unsigned long n);
+/* Latency below which 'pct' percent of successful ops completed, ns
+ * (to within the factor of two of a histogram bucket)
+ */
+extern unsigned long blkdev_stats_percentile(struct blkdev_op_stats *os, double pct);
+
+/* Group commit for flush implementations: callers that arrive while a
+ * flush is running wait for the next one, which then covers all of them,
+ * so N concurrent flushes cost at most two calls to 'flush'.
+ */
+struct blkdev_flush_group {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned long requested;    /* tickets handed out */
+    unsigned long done;         /* every ticket up to this one is flushed */
+    int running;
+    unsigned long unread;       /* callers yet to collect 'result' */
+    int result;                 /* of the last flush */
+};
+
+extern void blkdev_flush_group_init(struct blkdev_flush_group *g);
+extern void blkdev_flush_group_destroy(struct blkdev_flush_group *g);
+extern int blkdev_flush_group_run(struct blkdev_flush_group *g, int (*flush)(void *), void *arg);
+
+/* Fallback copy_range for implementations: read and write a chunk at a time */
+extern int blkdev_copy_range_slow(struct blkdev *dev, lba_t first_blk, struct blkdev *src,
+                                  lba_t src_blk, lba_t num_blks);
+
+/* Fallback write_zeroes for implementations: write zeros with 'write' */
+extern int blkdev_write_zeroes_slow(struct blkdev *dev,
+                                    int (*write)(struct blkdev *, lba_t, lba_t, void *),
+                                    lba_t first_blk, lba_t num_blks);
 
 #endif
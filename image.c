@@ -1,199 +1,776 @@
-/*
- * file:        image.c
- * description: skeleton code for CS 5600 Homework 2
- *
- * Peter Desnoyers, Northeastern Computer Science, 2011
- * $Id: image.c 421 2011-11-15 12:45:06Z pjd $
- */
-
-/* You should not modify this file, but you may be interested to understand the implementation */
-
-#define _XOPEN_SOURCE 600
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <assert.h>
-#include <errno.h>
-
-#include <unistd.h>
-#include <fcntl.h>
-#include <sys/stat.h>
-
-#include "blkdev.h"
-
-#define IMAGE_DEV_MAGIC 0x12340001
-
-struct image_dev {
-    int   magic;
-    char *path;
-    int   fd;
-    int   nblks;
-};
-
-int image_devs_open;            /* used for debugging */
-
-int image_test(struct blkdev *dev)
-{
-    struct image_dev *im = dev->private;
-    if (im->fd == -1)
-        return E_UNAVAIL;
-    else
-        return 0;
-}
-
-/* The blkdev operations - num_blocks, read, write, and close.
- */
-static int image_num_blocks(struct blkdev *dev)
-{
-    struct image_dev *im = dev->private;
-    assert(im != NULL && im->magic == IMAGE_DEV_MAGIC);
-    return im->nblks;
-}
-
-static int image_read(struct blkdev *dev, int offset, int len, void *buf)
-{
-    struct image_dev *im = dev->private;
-    assert(im->magic == IMAGE_DEV_MAGIC);
-
-    /* to fail a disk we close its file descriptor and set it to -1 */
-    if (im->fd == -1)
-        return E_UNAVAIL;
-
-    if (offset < 0 || offset+len > im->nblks)
-        return E_BADADDR;
-    
-    int result = pread(im->fd, buf, len*BLOCK_SIZE, offset*BLOCK_SIZE);
-
-    /* Since I'm not asking for the code that calls this to handle
-     * errors other than E_BADADDR and E_UNAVAIL, we report errors and
-     * then exit. Since we already checked the address, this shouldn't
-     * happen very often.
-     */
-    if (result < 0) {
-        fprintf(stderr, "read error on %s: %s\n", im->path, strerror(errno));
-        assert(0);
-    }
-    if (result != len*BLOCK_SIZE) {
-        fprintf(stderr, "short read on %s: %s\n", im->path, strerror(errno));
-        assert(0);
-    }
-    
-    return SUCCESS;
-}
-
-static int image_write(struct blkdev * dev, int offset, int len, void *buf)
-{
-    struct image_dev *im = dev->private;
-    assert(im->magic == IMAGE_DEV_MAGIC);
-
-    /* to fail a disk we close its file descriptor and set it to -1 */
-    if (im->fd == -1)
-        return E_UNAVAIL;
-
-    if (offset < 0 || offset+len > im->nblks)
-        return E_BADADDR;
-    
-    int result = pwrite(im->fd, buf, len*BLOCK_SIZE, offset*BLOCK_SIZE);
-
-    /* again, report the error and then exit with an assert
-     */
-    if (result != len*BLOCK_SIZE) {
-        fprintf(stderr, "write error on %s: %s\n", im->path, strerror(errno));
-        assert(0);
-    }
-
-    return SUCCESS;
-}
-
-void image_close(struct blkdev *dev)
-{
-    struct image_dev *im = dev->private;
-    assert(im->magic == IMAGE_DEV_MAGIC);
-
-    if (im->fd != -1)
-        close(im->fd);
-    free(im->path);
-    free(im);
-    dev->private = NULL;        /* crash any attempts to access */
-    free(dev);
-    
-    image_devs_open--;   /* to find upper layers that don't close() */
-}
-
-struct blkdev_ops image_ops = {
-    .num_blocks = image_num_blocks,
-    .read = image_read,
-    .write = image_write,
-    .close = image_close
-};
-
-/* create an image blkdev reading from a specified image file.
- */
-struct blkdev *image_create(char *path)
-{
-    struct blkdev *dev = malloc(sizeof(*dev));
-    struct image_dev *im = malloc(sizeof(*im));
-
-    if (dev == NULL || im == NULL)
-        return NULL;
-
-    im->path = strdup(path);    /* save a copy for error reporting */
-    
-    im->fd = open(path, O_RDWR);
-    if (im->fd < 0) {
-        fprintf(stderr, "can't open image %s: %s\n", path, strerror(errno));
-        return NULL;
-    }
-    struct stat sb;
-    if (fstat(im->fd, &sb) < 0) {
-        fprintf(stderr, "can't access image %s: %s\n", path, strerror(errno));
-        return NULL;
-    }
-
-    /* print a warning if file is not a multiple of the block size -
-     * this isn't a fatal error, as extra bytes beyond the last full
-     * block will be ignored by read and write.
-     */
-    if (sb.st_size % BLOCK_SIZE != 0)
-        fprintf(stderr, "warning: file %s not a multiple of %d bytes\n",
-                path, BLOCK_SIZE);
-    
-    im->nblks = sb.st_size / BLOCK_SIZE;
-    im->magic = IMAGE_DEV_MAGIC;
-    dev->private = im;
-    dev->ops = &image_ops;
-
-    image_devs_open++;          /* to find upper layers that don't close() */
-    
-    return dev;
-}
-
-/* force an image blkdev into failure. after this any further access
- * to that device will return E_UNAVAIL.
- */
-void image_fail(struct blkdev *dev)
-{
-    struct image_dev *im = dev->private;
-    assert(im->magic == IMAGE_DEV_MAGIC);
-
-    if (im->fd != -1)
-        close(im->fd);
-    im->fd = -1;
-}
-
-int blkdev_read(struct blkdev * dev, int first_blk, int num_blks, void *buf){
-    return dev->ops->read(dev, first_blk, num_blks, buf);
-}
-
-int blkdev_write(struct blkdev * dev, int first_blk, int num_blks, void *buf){
-    return dev->ops->write(dev, first_blk, num_blks, buf);
-}
-
-int blkdev_num_blocks(struct blkdev *dev){
-    return dev->ops->num_blocks(dev);
-}
-    
-void blkdev_close(struct blkdev *dev){
-    dev->ops->close(dev);
-}
+/*
+ * file:        image.c
+ * description: skeleton code for CS 5600 Homework 2
+ *
+ * Peter Desnoyers, Northeastern Computer Science, 2011
+ * $Id: image.c 421 2011-11-15 12:45:06Z pjd $
+ */
+
+/* You should not modify this file, but you may be interested to understand the implementation */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "blkdev.h"
+
+#define IMAGE_DEV_MAGIC 0x12340001
+#define ZERO_CHUNK (1 << 20)    /* bytes of zeros per write when zeroing by hand */
+
+struct image_dev {
+    int   magic;
+    char *path;
+    int   fd;
+    lba_t nblks;
+    int   bs;                   /* logical block size, bytes */
+    int   failed;               /* set by image_fail, fd stays open until close */
+    int   no_dsync;             /* kernel has no RWF_DSYNC, FUA is write + flush */
+    struct blkdev_flush_group flush;
+    struct blkdev_stats stats;
+};
+
+int image_devs_open;            /* used for debugging */
+
+int image_test(struct blkdev *dev)
+{
+    struct image_dev *im = dev->private;
+    if (__atomic_load_n(&im->failed, __ATOMIC_ACQUIRE))
+        return E_UNAVAIL;
+    else
+        return 0;
+}
+
+/* The blkdev operations - num_blocks, read, write, and close.
+ */
+static lba_t image_num_blocks(struct blkdev *dev)
+{
+    struct image_dev *im = dev->private;
+    assert(im != NULL && im->magic == IMAGE_DEV_MAGIC);
+    return im->nblks;
+}
+
+static int image_block_size(struct blkdev *dev)
+{
+    struct image_dev *im = dev->private;
+    return im->bs;
+}
+
+static int image_read_blocks(struct blkdev *dev, lba_t offset, lba_t len, void *buf)
+{
+    struct image_dev *im = dev->private;
+    assert(im->magic == IMAGE_DEV_MAGIC);
+
+    /* a failed disk keeps its descriptor open so that threads already
+     * inside pread/pwrite never see it closed (or reused) under them.
+     */
+    if (__atomic_load_n(&im->failed, __ATOMIC_ACQUIRE))
+        return E_UNAVAIL;
+
+    if (offset < 0 || len < 0 || offset > im->nblks - len)
+        return E_BADADDR;
+    
+    /* large transfers may complete in several pieces */
+    size_t done = 0, bytes = (size_t)len * im->bs;
+    off_t pos = (off_t)offset * im->bs;
+    while (done < bytes) {
+        ssize_t result = pread(im->fd, (char *)buf + done, bytes - done, pos + done);
+
+        /* Since I'm not asking for the code that calls this to handle
+         * errors other than E_BADADDR and E_UNAVAIL, we report errors and
+         * then exit. Since we already checked the address, this shouldn't
+         * happen very often.
+         */
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result < 0) {
+            fprintf(stderr, "read error on %s: %s\n", im->path, strerror(errno));
+            assert(0);
+        }
+        if (result == 0) {
+            fprintf(stderr, "short read on %s: %s\n", im->path, strerror(errno));
+            assert(0);
+        }
+        done += result;
+    }
+    
+    return SUCCESS;
+}
+
+static int image_fdatasync(void *arg)
+{
+    struct image_dev *im = arg;
+    if (fdatasync(im->fd) < 0) {
+        fprintf(stderr, "flush error on %s: %s\n", im->path, strerror(errno));
+        return E_UNAVAIL;
+    }
+    return SUCCESS;
+}
+
+/* pwrite only reaches the page cache; flush (fdatasync) is what makes
+ * it durable. Concurrent flushes share an fdatasync.
+ */
+static int image_flush_blocks(struct blkdev *dev)
+{
+    struct image_dev *im = dev->private;
+    assert(im->magic == IMAGE_DEV_MAGIC);
+
+    if (__atomic_load_n(&im->failed, __ATOMIC_ACQUIRE))
+        return E_UNAVAIL;
+    return blkdev_flush_group_run(&im->flush, image_fdatasync, im);
+}
+
+/* BLKDEV_FUA writes use RWF_DSYNC, which syncs just this range; older
+ * kernels get a flush after the write instead.
+ */
+static int image_write_blocks_flags(struct blkdev * dev, lba_t offset, lba_t len, void *buf,
+                                    int flags)
+{
+    struct image_dev *im = dev->private;
+    assert(im->magic == IMAGE_DEV_MAGIC);
+
+    /* a failed disk keeps its descriptor open so that threads already
+     * inside pread/pwrite never see it closed (or reused) under them.
+     */
+    if (__atomic_load_n(&im->failed, __ATOMIC_ACQUIRE))
+        return E_UNAVAIL;
+
+    if (offset < 0 || len < 0 || offset > im->nblks - len)
+        return E_BADADDR;
+    
+    int dsync = (flags & BLKDEV_FUA) && !__atomic_load_n(&im->no_dsync, __ATOMIC_RELAXED);
+    size_t done = 0, bytes = (size_t)len * im->bs;
+    off_t pos = (off_t)offset * im->bs;
+    while (done < bytes) {
+        ssize_t result;
+        if (dsync) {
+            struct iovec iov = {(char *)buf + done, bytes - done};
+            result = pwritev2(im->fd, &iov, 1, pos + done, RWF_DSYNC);
+            if (result < 0 && (errno == EOPNOTSUPP || errno == ENOSYS)) {
+                __atomic_store_n(&im->no_dsync, 1, __ATOMIC_RELAXED);
+                dsync = 0;
+                continue;
+            }
+        } else
+            result = pwrite(im->fd, (char *)buf + done, bytes - done, pos + done);
+
+        /* again, report the error and then exit with an assert
+         */
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0) {
+            fprintf(stderr, "write error on %s: %s\n", im->path, strerror(errno));
+            assert(0);
+        }
+        done += result;
+    }
+
+    if ((flags & BLKDEV_FUA) && !dsync)
+        return image_flush_blocks(dev);
+    return SUCCESS;
+}
+
+static int image_write_blocks(struct blkdev * dev, lba_t offset, lba_t len, void *buf)
+{
+    return image_write_blocks_flags(dev, offset, len, buf, 0);
+}
+
+/* discard is a hole punch, so the space goes back to the filesystem
+ * and the blocks read as zeros. Filesystems without hole punching leave
+ * the data in place, which discard allows.
+ */
+static int image_discard_blocks(struct blkdev *dev, lba_t offset, lba_t len)
+{
+    struct image_dev *im = dev->private;
+    assert(im->magic == IMAGE_DEV_MAGIC);
+
+    if (__atomic_load_n(&im->failed, __ATOMIC_ACQUIRE))
+        return E_UNAVAIL;
+
+    if (offset < 0 || len < 0 || offset > im->nblks - len)
+        return E_BADADDR;
+    if (len == 0)
+        return SUCCESS;
+
+    if (fallocate(im->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  (off_t)offset * im->bs, (off_t)len * im->bs) < 0 &&
+        errno != EOPNOTSUPP) {
+        fprintf(stderr, "discard error on %s: %s\n", im->path, strerror(errno));
+        assert(0);
+    }
+    return SUCCESS;
+}
+
+/* holes are found with SEEK_DATA/SEEK_HOLE. A block that is only partly
+ * allocated counts as data. Filesystems without them report the whole
+ * file as data, which is always safe.
+ */
+static int image_map_extent(struct blkdev *dev, lba_t offset, lba_t len, lba_t *ext)
+{
+    struct image_dev *im = dev->private;
+    assert(im->magic == IMAGE_DEV_MAGIC);
+
+    if (__atomic_load_n(&im->failed, __ATOMIC_ACQUIRE))
+        return E_UNAVAIL;
+
+    if (offset < 0 || len < 1 || offset > im->nblks - len)
+        return E_BADADDR;
+
+    off_t pos = (off_t)offset * im->bs, end = (off_t)(offset + len) * im->bs;
+    off_t data = lseek(im->fd, pos, SEEK_DATA);
+    *ext = len;
+    if (data < 0 && errno == ENXIO)
+        return BLKDEV_EXTENT_HOLE;      /* nothing allocated past pos */
+    if (data < 0)
+        return BLKDEV_EXTENT_DATA;
+    if (data >= end)
+        return BLKDEV_EXTENT_HOLE;
+    if (data - pos >= im->bs) {
+        *ext = (data - pos) / im->bs;
+        return BLKDEV_EXTENT_HOLE;
+    }
+
+    off_t hole = lseek(im->fd, data, SEEK_HOLE);
+    if (hole >= 0 && hole < end)
+        *ext = (hole - pos + im->bs - 1) / im->bs;
+    return BLKDEV_EXTENT_DATA;
+}
+
+extern struct blkdev_ops image_ops;
+
+/* copies between two images are done by the kernel with
+ * copy_file_range, which may just share the blocks (reflink) or copy
+ * them without passing through user space. Anything else - another kind
+ * of source, or a kernel or filesystem pair that can't do it - is read
+ * and written a chunk at a time, and those reads and writes keep their
+ * own statistics.
+ */
+static int image_copy_range(struct blkdev *dev, lba_t offset, struct blkdev *src,
+                            lba_t src_offset, lba_t len)
+{
+    struct image_dev *im = dev->private, *sim;
+    unsigned long t0 = blkdev_stats_start();
+    assert(im->magic == IMAGE_DEV_MAGIC);
+
+    if (src->ops != &image_ops)
+        return blkdev_copy_range_slow(dev, offset, src, src_offset, len);
+    sim = src->private;
+    if (sim->bs != im->bs) {
+        blkdev_stats_end(&im->stats, BLKDEV_OP_WRITE, 0, E_BADADDR, t0);
+        return E_BADADDR;
+    }
+
+    if (__atomic_load_n(&im->failed, __ATOMIC_ACQUIRE) ||
+        __atomic_load_n(&sim->failed, __ATOMIC_ACQUIRE)) {
+        blkdev_stats_end(&im->stats, BLKDEV_OP_WRITE, 0, E_UNAVAIL, t0);
+        return E_UNAVAIL;
+    }
+
+    if (offset < 0 || len < 0 || offset > im->nblks - len ||
+        src_offset < 0 || src_offset > sim->nblks - len) {
+        blkdev_stats_end(&im->stats, BLKDEV_OP_WRITE, 0, E_BADADDR, t0);
+        return E_BADADDR;
+    }
+
+    loff_t in = (loff_t)src_offset * im->bs, out = (loff_t)offset * im->bs;
+    size_t left = (size_t)len * im->bs;
+    while (left > 0) {
+        ssize_t result = copy_file_range(sim->fd, &in, im->fd, &out, left, 0);
+        if (result <= 0) {
+            if (result == 0 || errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                errno == EOPNOTSUPP)
+                break;
+            fprintf(stderr, "copy error on %s: %s\n", im->path, strerror(errno));
+            assert(0);
+        }
+        left -= result;
+    }
+
+    /* copy_file_range moves bytes, so partial progress may end
+     * mid-block; the slow path restarts at that block
+     */
+    lba_t done = len - (lba_t)((left + im->bs - 1) / im->bs);
+    if (done > 0) {
+        blkdev_stats_end(&sim->stats, BLKDEV_OP_READ, done, SUCCESS, t0);
+        blkdev_stats_end(&im->stats, BLKDEV_OP_WRITE, done, SUCCESS, t0);
+    }
+    if (done < len)
+        return blkdev_copy_range_slow(dev, offset + done, src, src_offset + done, len - done);
+    return SUCCESS;
+}
+
+/* zero a range without writing it: ZERO_RANGE keeps the space
+ * allocated, PUNCH_HOLE frees it; if the filesystem can do neither,
+ * write zeros.
+ */
+static int image_write_zeroes_blocks(struct blkdev *dev, lba_t offset, lba_t len)
+{
+    struct image_dev *im = dev->private;
+    off_t pos, bytes;
+    assert(im->magic == IMAGE_DEV_MAGIC);
+
+    if (__atomic_load_n(&im->failed, __ATOMIC_ACQUIRE))
+        return E_UNAVAIL;
+
+    if (offset < 0 || len < 0 || offset > im->nblks - len)
+        return E_BADADDR;
+    if (len == 0)
+        return SUCCESS;
+
+    pos = (off_t)offset * im->bs;
+    bytes = (off_t)len * im->bs;
+    if (fallocate(im->fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, pos, bytes) == 0 ||
+        fallocate(im->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, bytes) == 0)
+        return SUCCESS;
+    if (errno != EOPNOTSUPP) {
+        fprintf(stderr, "write zeroes error on %s: %s\n", im->path, strerror(errno));
+        assert(0);
+    }
+    return blkdev_write_zeroes_slow(dev, image_write_blocks, offset, len);
+}
+
+static int image_read(struct blkdev *dev, lba_t offset, lba_t len, void *buf)
+{
+    struct image_dev *im = dev->private;
+    unsigned long t0 = blkdev_stats_start();
+    int val = image_read_blocks(dev, offset, len, buf);
+    blkdev_stats_end(&im->stats, BLKDEV_OP_READ, len, val, t0);
+    return val;
+}
+
+static int image_write(struct blkdev *dev, lba_t offset, lba_t len, void *buf)
+{
+    struct image_dev *im = dev->private;
+    unsigned long t0 = blkdev_stats_start();
+    int val = image_write_blocks(dev, offset, len, buf);
+    blkdev_stats_end(&im->stats, BLKDEV_OP_WRITE, len, val, t0);
+    return val;
+}
+
+static int image_discard(struct blkdev *dev, lba_t offset, lba_t len)
+{
+    struct image_dev *im = dev->private;
+    unsigned long t0 = blkdev_stats_start();
+    int val = image_discard_blocks(dev, offset, len);
+    blkdev_stats_end(&im->stats, BLKDEV_OP_DISCARD, len, val, t0);
+    return val;
+}
+
+static int image_write_zeroes(struct blkdev *dev, lba_t offset, lba_t len)
+{
+    struct image_dev *im = dev->private;
+    unsigned long t0 = blkdev_stats_start();
+    int val = image_write_zeroes_blocks(dev, offset, len);
+    blkdev_stats_end(&im->stats, BLKDEV_OP_WRITE_ZEROES, len, val, t0);
+    return val;
+}
+
+static int image_write_flags(struct blkdev *dev, lba_t offset, lba_t len, void *buf, int flags)
+{
+    struct image_dev *im = dev->private;
+    unsigned long t0 = blkdev_stats_start();
+    int val = image_write_blocks_flags(dev, offset, len, buf, flags);
+    blkdev_stats_end(&im->stats, BLKDEV_OP_WRITE, len, val, t0);
+    return val;
+}
+
+static int image_flush(struct blkdev *dev)
+{
+    struct image_dev *im = dev->private;
+    unsigned long t0 = blkdev_stats_start();
+    int val = image_flush_blocks(dev);
+    blkdev_stats_end(&im->stats, BLKDEV_OP_FLUSH, 0, val, t0);
+    return val;
+}
+
+static struct blkdev_stats *image_stats(struct blkdev *dev)
+{
+    struct image_dev *im = dev->private;
+    assert(im->magic == IMAGE_DEV_MAGIC);
+    return &im->stats;
+}
+
+void image_close(struct blkdev *dev)
+{
+    struct image_dev *im = dev->private;
+    assert(im->magic == IMAGE_DEV_MAGIC);
+
+    close(im->fd);
+    blkdev_flush_group_destroy(&im->flush);
+    free(im->path);
+    free(im);
+    dev->private = NULL;        /* crash any attempts to access */
+    free(dev);
+    
+    __atomic_sub_fetch(&image_devs_open, 1, __ATOMIC_RELAXED);   /* to find upper layers that don't close() */
+}
+
+struct blkdev_ops image_ops = {
+    .num_blocks = image_num_blocks,
+    .read = image_read,
+    .write = image_write,
+    .close = image_close,
+    .stats = image_stats,
+    .block_size = image_block_size,
+    .discard = image_discard,
+    .write_zeroes = image_write_zeroes,
+    .flush = image_flush,
+    .write_flags = image_write_flags,
+    .map_extent = image_map_extent,
+    .copy_range = image_copy_range,
+    .name = "image"
+};
+
+/* create an image blkdev reading from a specified image file, with
+ * 'block_size'-byte logical blocks.
+ */
+struct blkdev *image_create_bs(char *path, int block_size)
+{
+    struct blkdev *dev;
+    struct image_dev *im;
+
+    if (block_size < BLOCK_SIZE || block_size > BLOCK_SIZE_MAX ||
+        (block_size & (block_size - 1)) != 0) {
+        fprintf(stderr, "image %s: bad block size %d\n", path, block_size);
+        return NULL;
+    }
+
+    dev = malloc(sizeof(*dev));
+    im = calloc(1, sizeof(*im));
+    if (dev == NULL || im == NULL)
+        return NULL;
+
+    im->path = strdup(path);    /* save a copy for error reporting */
+    
+    im->fd = open(path, O_RDWR);
+    if (im->fd < 0) {
+        fprintf(stderr, "can't open image %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    struct stat sb;
+    if (fstat(im->fd, &sb) < 0) {
+        fprintf(stderr, "can't access image %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    /* print a warning if file is not a multiple of the block size -
+     * this isn't a fatal error, as extra bytes beyond the last full
+     * block will be ignored by read and write.
+     */
+    if (sb.st_size % block_size != 0)
+        fprintf(stderr, "warning: file %s not a multiple of %d bytes\n",
+                path, block_size);
+    
+    im->nblks = sb.st_size / block_size;
+    im->bs = block_size;
+    blkdev_flush_group_init(&im->flush);
+    im->failed = 0;
+    im->magic = IMAGE_DEV_MAGIC;
+    dev->private = im;
+    dev->ops = &image_ops;
+
+    __atomic_add_fetch(&image_devs_open, 1, __ATOMIC_RELAXED);   /* to find upper layers that don't close() */
+    
+    return dev;
+}
+
+/* create an image blkdev with the default BLOCK_SIZE blocks.
+ */
+struct blkdev *image_create(char *path)
+{
+    return image_create_bs(path, BLOCK_SIZE);
+}
+
+/* force an image blkdev into failure. after this any further access
+ * to that device will return E_UNAVAIL.
+ */
+void image_fail(struct blkdev *dev)
+{
+    struct image_dev *im = dev->private;
+    assert(im->magic == IMAGE_DEV_MAGIC);
+
+    __atomic_store_n(&im->failed, 1, __ATOMIC_RELEASE);
+}
+
+int blkdev_read(struct blkdev * dev, lba_t first_blk, lba_t num_blks, void *buf){
+    return dev->ops->read(dev, first_blk, num_blks, buf);
+}
+
+int blkdev_write(struct blkdev * dev, lba_t first_blk, lba_t num_blks, void *buf){
+    return dev->ops->write(dev, first_blk, num_blks, buf);
+}
+
+lba_t blkdev_num_blocks(struct blkdev *dev){
+    return dev->ops->num_blocks(dev);
+}
+
+int blkdev_block_size(struct blkdev *dev){
+    return dev->ops->block_size ? dev->ops->block_size(dev) : BLOCK_SIZE;
+}
+
+int blkdev_discard(struct blkdev *dev, lba_t first_blk, lba_t num_blks){
+    return dev->ops->discard ? dev->ops->discard(dev, first_blk, num_blks) : SUCCESS;
+}
+
+/* zero blocks by writing zeros with 'write', a chunk at a time - for
+ * devices that can't zero any other way.
+ */
+int blkdev_write_zeroes_slow(struct blkdev *dev,
+                             int (*write)(struct blkdev *, lba_t, lba_t, void *),
+                             lba_t first_blk, lba_t num_blks){
+    int bs = blkdev_block_size(dev), val = SUCCESS;
+    lba_t chunk = ZERO_CHUNK / bs > 0 ? ZERO_CHUNK / bs : 1, n;
+    void *zeros = calloc(chunk, bs);
+
+    if (zeros == NULL)
+        return E_UNAVAIL;
+    for (; num_blks > 0 && val == SUCCESS; first_blk += n, num_blks -= n) {
+        n = num_blks < chunk ? num_blks : chunk;
+        val = write(dev, first_blk, n, zeros);
+    }
+    free(zeros);
+    return val;
+}
+
+int blkdev_flush(struct blkdev *dev){
+    return dev->ops->flush ? dev->ops->flush(dev) : SUCCESS;
+}
+
+int blkdev_map_extent(struct blkdev *dev, lba_t first_blk, lba_t num_blks, lba_t *len){
+    if (dev->ops->map_extent)
+        return dev->ops->map_extent(dev, first_blk, num_blks, len);
+    *len = num_blks;
+    return BLKDEV_EXTENT_DATA;
+}
+
+/* copy by reading and writing a chunk at a time */
+int blkdev_copy_range_slow(struct blkdev *dev, lba_t first_blk, struct blkdev *src,
+                           lba_t src_blk, lba_t num_blks){
+    int bs = blkdev_block_size(dev), val = SUCCESS;
+    lba_t chunk = ZERO_CHUNK / bs > 0 ? ZERO_CHUNK / bs : 1, n;
+    void *buf;
+
+    if (blkdev_block_size(src) != bs)
+        return E_BADADDR;
+    buf = malloc((size_t)chunk * bs);
+    if (buf == NULL)
+        return E_UNAVAIL;
+    for (; num_blks > 0 && val == SUCCESS; first_blk += n, src_blk += n, num_blks -= n) {
+        n = num_blks < chunk ? num_blks : chunk;
+        val = src->ops->read(src, src_blk, n, buf);
+        if (val == SUCCESS)
+            val = dev->ops->write(dev, first_blk, n, buf);
+    }
+    free(buf);
+    return val;
+}
+
+int blkdev_copy_range(struct blkdev *dev, lba_t first_blk, struct blkdev *src,
+                      lba_t src_blk, lba_t num_blks){
+    if (dev->ops->copy_range)
+        return dev->ops->copy_range(dev, first_blk, src, src_blk, num_blks);
+    return blkdev_copy_range_slow(dev, first_blk, src, src_blk, num_blks);
+}
+
+int blkdev_write_flags(struct blkdev *dev, lba_t first_blk, lba_t num_blks, void *buf,
+                       int flags){
+    int val;
+    if (dev->ops->write_flags)
+        return dev->ops->write_flags(dev, first_blk, num_blks, buf, flags);
+    val = dev->ops->write(dev, first_blk, num_blks, buf);
+    if (val == SUCCESS && (flags & BLKDEV_FUA))
+        val = blkdev_flush(dev);
+    return val;
+}
+
+void blkdev_flush_group_init(struct blkdev_flush_group *g){
+    pthread_mutex_init(&g->lock, NULL);
+    pthread_cond_init(&g->cond, NULL);
+    g->requested = g->done = 0;
+    g->running = 0;
+    g->unread = 0;
+    g->result = SUCCESS;
+}
+
+void blkdev_flush_group_destroy(struct blkdev_flush_group *g){
+    pthread_cond_destroy(&g->cond);
+    pthread_mutex_destroy(&g->lock);
+}
+
+/* take a ticket; whoever finds no flush running flushes on behalf of
+ * every ticket handed out so far. A flush that was already running when
+ * we arrived may have missed our writes, so it doesn't count for us.
+ * The next flush doesn't start until everyone the last one covered has
+ * picked up its result, so nobody returns the result of a later flush.
+ */
+int blkdev_flush_group_run(struct blkdev_flush_group *g, int (*flush)(void *), void *arg){
+    unsigned long ticket, upto;
+    int val, flushed = 0;
+
+    pthread_mutex_lock(&g->lock);
+    ticket = ++g->requested;
+    while (g->done < ticket) {
+        if (g->running || g->unread > 0) {
+            pthread_cond_wait(&g->cond, &g->lock);
+            continue;
+        }
+        g->running = 1;
+        upto = g->requested;
+        pthread_mutex_unlock(&g->lock);
+        val = flush(arg);
+        pthread_mutex_lock(&g->lock);
+        g->running = 0;
+        g->unread = upto - g->done - 1;     /* every ticket covered but ours */
+        g->done = upto;
+        g->result = val;
+        flushed = 1;
+        pthread_cond_broadcast(&g->cond);
+    }
+    val = g->result;
+    if (!flushed && --g->unread == 0)
+        pthread_cond_broadcast(&g->cond);
+    pthread_mutex_unlock(&g->lock);
+    return val;
+}
+
+int blkdev_write_zeroes(struct blkdev *dev, lba_t first_blk, lba_t num_blks){
+    if (dev->ops->write_zeroes)
+        return dev->ops->write_zeroes(dev, first_blk, num_blks);
+    return blkdev_write_zeroes_slow(dev, dev->ops->write, first_blk, num_blks);
+}
+    
+void blkdev_close(struct blkdev *dev){
+    dev->ops->close(dev);
+}
+
+/* Statistics. Counters are updated with relaxed atomics, so they are
+ * cheap on the I/O path and may be read while I/O is in progress.
+ */
+unsigned long blkdev_stats_start(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+void blkdev_stats_add(unsigned long *counter, unsigned long n)
+{
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+void blkdev_stats_end(struct blkdev_stats *st, int op, lba_t num_blks, int result,
+                      unsigned long start)
+{
+    struct blkdev_op_stats *os = &st->op[op];
+    unsigned long ns = blkdev_stats_start() - start;
+    int b = ns ? 63 - __builtin_clzl(ns) : 0;
+
+    if (b >= BLKDEV_LAT_BUCKETS)
+        b = BLKDEV_LAT_BUCKETS - 1;
+    blkdev_stats_add(&os->ops, 1);
+    if (result != SUCCESS) {
+        blkdev_stats_add(&os->errors, 1);
+        return;
+    }
+    blkdev_stats_add(&os->blocks, num_blks);
+    blkdev_stats_add(&os->total_ns, ns);
+    blkdev_stats_add(&os->lat[b], 1);
+}
+
+int blkdev_get_stats(struct blkdev *dev, struct blkdev_stats *st)
+{
+    unsigned long *src, *dst = (unsigned long *)st;
+    size_t i;
+
+    if (dev->ops->stats == NULL)
+        return E_UNAVAIL;
+    src = (unsigned long *)dev->ops->stats(dev);
+    for (i = 0; i < sizeof(*st) / sizeof(unsigned long); i++)
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    return SUCCESS;
+}
+
+/* latency below which 'pct' percent of operations completed, to the
+ * upper edge of its bucket
+ */
+unsigned long blkdev_stats_percentile(struct blkdev_op_stats *os, double pct)
+{
+    unsigned long want = (unsigned long)(os->ops - os->errors) * pct / 100, seen = 0;
+    int b;
+    for (b = 0; b < BLKDEV_LAT_BUCKETS - 1; b++) {
+        seen += os->lat[b];
+        if (seen > want)
+            break;
+    }
+    return 2UL << b;
+}
+
+static double stats_percentile_us(struct blkdev_op_stats *os, double pct)
+{
+    return blkdev_stats_percentile(os, pct) / 1000.0;
+}
+
+static void stats_dump(struct blkdev *dev, FILE *fp, int depth)
+{
+    static const char *opname[BLKDEV_NR_OPS] = {"read", "write", "discard", "zeroes", "flush"};
+    struct blkdev_stats st;
+    struct blkdev *members[64];
+    int i, n;
+
+    fprintf(fp, "%*s%s:\n", depth * 2, "", dev->ops->name ? dev->ops->name : "blkdev");
+    if (blkdev_get_stats(dev, &st) == SUCCESS) {
+        for (i = 0; i < BLKDEV_NR_OPS; i++) {
+            struct blkdev_op_stats *os = &st.op[i];
+            unsigned long good = os->ops - os->errors;
+            if (i >= BLKDEV_OP_DISCARD && os->ops == 0)
+                continue;
+            fprintf(fp, "%*s  %-5s ops=%lu blocks=%lu errors=%lu", depth * 2, "",
+                    opname[i], os->ops, os->blocks, os->errors);
+            if (good)
+                fprintf(fp, " avg=%.1fus p50<%.1fus p99<%.1fus",
+                        os->total_ns / 1000.0 / good, stats_percentile_us(os, 50),
+                        stats_percentile_us(os, 99));
+            fprintf(fp, "\n");
+        }
+        if (st.degraded_reads || st.rmw_writes || st.full_stripe_writes)
+            fprintf(fp, "%*s  degraded=%lu rmw=%lu full-stripe=%lu\n", depth * 2, "",
+                    st.degraded_reads, st.rmw_writes, st.full_stripe_writes);
+        if (st.rebuilt || st.rebuild_skipped)
+            fprintf(fp, "%*s  rebuilt=%lu rebuild-skipped=%lu\n", depth * 2, "",
+                    st.rebuilt, st.rebuild_skipped);
+        if (st.hedged_reads)
+            fprintf(fp, "%*s  hedged=%lu hedge-wins=%lu\n", depth * 2, "",
+                    st.hedged_reads, st.hedge_wins);
+        if (st.throttled_ns)
+            fprintf(fp, "%*s  throttled=%.1fms\n", depth * 2, "", st.throttled_ns / 1e6);
+        if (st.scrubbed)
+            fprintf(fp, "%*s  scrubbed=%lu mismatches=%lu\n", depth * 2, "",
+                    st.scrubbed, st.scrub_mismatches);
+        if (st.csum_errors || st.read_repairs)
+            fprintf(fp, "%*s  csum-errors=%lu read-repairs=%lu\n", depth * 2, "",
+                    st.csum_errors, st.read_repairs);
+        if (st.remapped)
+            fprintf(fp, "%*s  remapped=%lu\n", depth * 2, "", st.remapped);
+    }
+    if (dev->ops->members != NULL) {
+        n = dev->ops->members(dev, members, 64);
+        for (i = 0; i < n; i++)
+            stats_dump(members[i], fp, depth + 1);
+    }
+}
+
+void blkdev_dump_stats(struct blkdev *dev, FILE *fp)
+{
+    stats_dump(dev, fp, 0);
+}
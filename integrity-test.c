@@ -0,0 +1,222 @@
+#include "blkdev.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+
+#define NBLKS 4096
+
+static unsigned long now_ns(void)
+{
+    return blkdev_stats_start();
+}
+
+/* block 'blk' of the test pattern */
+static void fill(char *buf, lba_t blk, lba_t n, int bs)
+{
+    for (lba_t i = 0; i < n * bs; i++)
+        buf[i] = (char)((blk * bs + i) * 7 + 3);
+}
+
+static int check(char *buf, lba_t blk, lba_t n, int bs)
+{
+    char *want = malloc(n * bs);
+    fill(want, blk, n, bs);
+    int same = memcmp(buf, want, n * bs) == 0;
+    free(want);
+    return same;
+}
+
+/* flip a byte of block 'blk' behind the integrity layer's back */
+static void corrupt(struct blkdev *raw, lba_t blk)
+{
+    char buf[BLOCK_SIZE];
+    assert(blkdev_read(raw, blk, 1, buf) == SUCCESS);
+    buf[100] ^= 0x40;
+    assert(blkdev_write(raw, blk, 1, buf) == SUCCESS);
+}
+
+struct overwriter {
+    struct blkdev *dev;
+    int byte;
+};
+
+/* write blocks 40-43 with this writer's byte */
+static void *overwrite(void *arg)
+{
+    struct overwriter *w = arg;
+    char buf[4 * BLOCK_SIZE];
+    memset(buf, w->byte, sizeof(buf));
+    assert(blkdev_write(w->dev, 40, 4, buf) == SUCCESS);
+    return NULL;
+}
+
+int main() {
+    char *buf = malloc(64 * BLOCK_SIZE);
+    struct blkdev_stats st;
+
+    // the standard check value, and carrying on from a partial CRC
+    assert(crc32c(0, "123456789", 9) == 0xe3069283);
+    assert(crc32c(crc32c(0, "1234", 4), "56789", 5) == 0xe3069283);
+
+    // checksums go at the end, and are the CRC32C of each block
+    struct blkdev *raw = ramdisk_create(NBLKS);
+    struct blkdev *dev = integrity_create(raw);
+    lba_t n = blkdev_num_blocks(dev);
+    assert(n > NBLKS - NBLKS / 100 && n < NBLKS);
+    fill(buf, 0, 64, BLOCK_SIZE);
+    assert(blkdev_write(dev, 0, 64, buf) == SUCCESS);
+    uint32_t table[BLOCK_SIZE / 4];
+    assert(blkdev_read(raw, n, 1, table) == SUCCESS);
+    for (int i = 0; i < 64; i++)
+        assert(table[i] == crc32c(0, buf + i * BLOCK_SIZE, BLOCK_SIZE));
+    assert(blkdev_read(dev, n, 1, buf) == E_BADADDR);
+
+    // a corrupt block fails the read it is in, and a rewrite fixes it
+    corrupt(raw, 5);
+    assert(blkdev_read(dev, 0, 8, buf) == E_CORRUPT);
+    assert(blkdev_read(dev, 8, 8, buf) == SUCCESS && check(buf, 8, 8, BLOCK_SIZE));
+    assert(blkdev_get_stats(dev, &st) == SUCCESS && st.csum_errors == 1);
+    fill(buf, 5, 1, BLOCK_SIZE);
+    assert(blkdev_write(dev, 5, 1, buf) == SUCCESS);
+    assert(blkdev_read(dev, 0, 8, buf) == SUCCESS && check(buf, 0, 8, BLOCK_SIZE));
+
+    // zeroed blocks check out
+    assert(blkdev_write_zeroes(dev, 10, 20) == SUCCESS);
+    assert(blkdev_read(dev, 0, 64, buf) == SUCCESS);
+    assert(buf[10 * BLOCK_SIZE] == 0 && buf[30 * BLOCK_SIZE - 1] == 0);
+    blkdev_close(dev);
+
+    // racing writes to the same blocks leave one writer's data with its
+    // own checksums, however the device underneath orders them
+    struct sim_params sp = {.seed = 3};
+    struct blkdev *slow = sim_create(ramdisk_create(NBLKS), &sp);
+    dev = integrity_create(slow);
+    sp.lat_dist = SIM_LAT_UNIFORM;
+    sp.lat_ns = 1000000;
+    sim_configure(slow, &sp);
+    for (int k = 0; k < 20; k++) {
+        pthread_t th[2];
+        struct overwriter w[2] = {{dev, 0x11}, {dev, 0x22}};
+        for (int i = 0; i < 2; i++)
+            assert(pthread_create(&th[i], NULL, overwrite, &w[i]) == 0);
+        for (int i = 0; i < 2; i++)
+            pthread_join(th[i], NULL);
+        assert(blkdev_read(dev, 40, 4, buf) == SUCCESS);
+        assert(buf[0] == buf[4 * BLOCK_SIZE - 1]);
+    }
+    blkdev_close(dev);
+
+    // checksums persist: a reopened image isn't reformatted, so damage
+    // done while it was closed is found
+    FILE *fp = fopen("test1", "w");
+    assert(fp != NULL && ftruncate(fileno(fp), NBLKS * BLOCK_SIZE) == 0);
+    fclose(fp);
+    dev = integrity_create(image_create("test1"));
+    fill(buf, 0, 64, BLOCK_SIZE);
+    assert(blkdev_write(dev, 0, 64, buf) == SUCCESS);
+    blkdev_close(dev);
+    raw = image_create("test1");
+    corrupt(raw, 33);
+    blkdev_close(raw);
+    dev = integrity_create(image_create("test1"));
+    assert(blkdev_read(dev, 0, 32, buf) == SUCCESS && check(buf, 0, 32, BLOCK_SIZE));
+    assert(blkdev_read(dev, 32, 2, buf) == E_CORRUPT);
+    blkdev_close(dev);
+
+    // a mirror reads a corrupt block from the other side and repairs it
+    struct blkdev *legs[2], *rawlegs[2];
+    for (int i = 0; i < 2; i++)
+        legs[i] = integrity_create(rawlegs[i] = ramdisk_create(NBLKS));
+    struct blkdev *mirror = mirror_create(legs);
+    fill(buf, 0, 64, BLOCK_SIZE);
+    assert(blkdev_write(mirror, 0, 64, buf) == SUCCESS);
+    corrupt(rawlegs[0], 10);
+    memset(buf, 0, 64 * BLOCK_SIZE);
+    assert(blkdev_read(mirror, 8, 4, buf) == SUCCESS && check(buf, 8, 4, BLOCK_SIZE));
+    assert(blkdev_get_stats(mirror, &st) == SUCCESS && st.read_repairs == 4);
+    assert(blkdev_read(legs[0], 8, 4, buf) == SUCCESS && check(buf, 8, 4, BLOCK_SIZE));
+
+    // ... when hedged too
+    mirror_set_hedge(mirror, 1000000000L);
+    corrupt(rawlegs[0], 20);
+    assert(blkdev_read(mirror, 20, 1, buf) == SUCCESS && check(buf, 20, 1, BLOCK_SIZE));
+    assert(blkdev_get_stats(mirror, &st) == SUCCESS && st.read_repairs == 5);
+    assert(blkdev_read(legs[0], 20, 1, buf) == SUCCESS);
+    mirror_set_hedge(mirror, 0);
+
+    // both copies bad is an error, but neither side has failed
+    corrupt(rawlegs[0], 30);
+    corrupt(rawlegs[1], 30);
+    assert(blkdev_read(mirror, 30, 1, buf) == E_CORRUPT);
+    assert(blkdev_read(mirror, 31, 1, buf) == SUCCESS && check(buf, 31, 1, BLOCK_SIZE));
+    fill(buf, 30, 1, BLOCK_SIZE);
+    assert(blkdev_write(mirror, 30, 1, buf) == SUCCESS);
+
+    // scrub rewrites the side that failed its checksum, even side 0
+    corrupt(rawlegs[0], 40);
+    struct raid_scrub s = {.flags = RAID_SCRUB_REPAIR};
+    assert(raid_scrub(mirror, &s) == SUCCESS);
+    assert(s.mismatched == 64 && s.repaired == 64);
+    assert(blkdev_read(legs[0], 0, 64, buf) == SUCCESS && check(buf, 0, 64, BLOCK_SIZE));
+    blkdev_close(mirror);
+
+    // raid4 reconstructs a corrupt strip from parity and rewrites it
+    struct blkdev *members[3], *rawmembers[3];
+    for (int i = 0; i < 3; i++)
+        members[i] = integrity_create(rawmembers[i] = ramdisk_create(NBLKS));
+    struct blkdev *raid4 = raid4_create(3, members, 4);
+    fill(buf, 0, 64, BLOCK_SIZE);
+    assert(blkdev_write(raid4, 0, 64, buf) == SUCCESS);
+    corrupt(rawmembers[1], 1);  // block 5 of the array
+    memset(buf, 0, 64 * BLOCK_SIZE);
+    assert(blkdev_read(raid4, 0, 16, buf) == SUCCESS && check(buf, 0, 16, BLOCK_SIZE));
+    assert(blkdev_get_stats(raid4, &st) == SUCCESS && st.read_repairs == 4);
+    assert(blkdev_read(members[1], 0, 4, buf) == SUCCESS);
+
+    // scrub repairs corrupt parity and corrupt data alike
+    corrupt(rawmembers[2], 0);  // parity of row 0
+    corrupt(rawmembers[0], 9);  // block 17 of the array, row 2
+    memset(&s, 0, sizeof(s));
+    s.flags = RAID_SCRUB_REPAIR;
+    assert(raid_scrub(raid4, &s) == SUCCESS);
+    assert(s.mismatched == 8 && s.repaired == 8);
+    for (int i = 0; i < 3; i++)
+        assert(blkdev_read(members[i], 0, 16, buf) == SUCCESS);
+    assert(blkdev_read(raid4, 0, 64, buf) == SUCCESS && check(buf, 0, 64, BLOCK_SIZE));
+    assert(blkdev_get_stats(raid4, &st) == SUCCESS && st.read_repairs == 4);
+    blkdev_close(raid4);
+
+    // what checking costs: CRC32C alone, and reads with and without it
+    size_t len = 64 << 20;
+    char *big = malloc(len);
+    for (size_t i = 0; i < len; i++)
+        big[i] = (char)(i * 2654435761u >> 13);
+    unsigned long t0 = now_ns();
+    uint32_t sum = crc32c(0, big, len);
+    double crc_s = (now_ns() - t0) / 1e9;
+    raw = ramdisk_create_bs(len / 4096 + 64, 4096, 0);
+    dev = integrity_create(raw);
+    assert(blkdev_write(dev, 0, len / 4096, big) == SUCCESS);
+    t0 = now_ns();
+    for (int k = 0; k < 4; k++)
+        for (size_t off = 0; off < len; off += 1 << 20)
+            assert(blkdev_read(raw, off / 4096, 256, big + off) == SUCCESS);
+    double raw_s = (now_ns() - t0) / 1e9;
+    t0 = now_ns();
+    for (int k = 0; k < 4; k++)
+        for (size_t off = 0; off < len; off += 1 << 20)
+            assert(blkdev_read(dev, off / 4096, 256, big + off) == SUCCESS);
+    double chk_s = (now_ns() - t0) / 1e9;
+    assert(crc32c(0, big, len) == sum);
+    printf("crc32c %.1f GB/s; 4 KiB reads %.1f GB/s raw, %.1f GB/s checked\n",
+           len / crc_s / 1e9, 4 * len / raw_s / 1e9, 4 * len / chk_s / 1e9);
+    blkdev_close(dev);
+    free(big);
+
+    free(buf);
+    printf("integrity test passed\n");
+}
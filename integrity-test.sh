@@ -0,0 +1,2 @@
+gcc -g -w -pthread -o integrity-test integrity-test.c integrity.c image.c ramdisk.c sim.c raid.c -lm && ./integrity-test &&
+rm test[0-9]*
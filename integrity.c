@@ -0,0 +1,576 @@
+/*
+ * file:        integrity.c
+ * description: per-block CRC32C checksums, stackable in front of any
+ *              blkdev
+ *
+ * The integrity layer keeps a CRC32C of every block in a sidecar at the
+ * end of the device underneath: a table of 4-byte checksums, then a
+ * header block in the last block. The table is held in memory and
+ * written through, a table block at a time, after the data it covers.
+ * Reads are verified against it and fail with E_CORRUPT if any block
+ * doesn't match, which the RAID layers repair from the mirror's other
+ * side or from parity. A device without a header is formatted by
+ * checksumming what it holds, so an existing image can be put under
+ * the layer as it is.
+ *
+ * A write holds the locks of the table blocks it touches from its data
+ * write through its table write, so two writes to the same block can't
+ * leave the data of one and the checksum of the other. A crash between
+ * a data write and its table write leaves blocks that read E_CORRUPT
+ * until they are written again (or repaired from a redundant copy).
+ *
+ * CRC32C uses the SSE4.2 crc32 instruction where the CPU has it. A
+ * block is checksummed as three interleaved lanes, which hides the
+ * instruction's latency, and the lanes are joined with tables that
+ * shift a CRC over a lane's worth of zeros. Without SSE4.2 a byte table
+ * is used.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "blkdev.h"
+
+#define INTEGRITY_DEV_MAGIC 0x12340030
+#define INTEGRITY_MAGIC 0x31435243      /* "CRC1" in the header block */
+#define INTEGRITY_LOCKS 64              /* table block locks, hashed; one bit each
+                                         * in a uint64_t */
+#define INTEGRITY_CHUNK 256             /* blocks read at a time by format */
+
+#define CRC32C_POLY 0x82f63b78          /* reflected Castagnoli polynomial */
+
+struct integrity_header {
+    uint32_t magic;
+    uint32_t bs;
+    int64_t nblks;
+    uint32_t crc;                       /* of the fields above */
+};
+
+/* joins three CRC lanes of 'lane' bytes: shift[k][v] is the CRC
+ * register (v << 8k) advanced over 'lane' zero bytes
+ */
+struct crc_lanes {
+    size_t lane;
+    uint32_t shift[4][256];
+};
+
+struct integrity_dev {
+    int magic;
+    struct blkdev *dev;
+    lba_t nblks;                /* data blocks */
+    lba_t table;                /* first block of the checksum table */
+    lba_t ntable;               /* ... and how many there are */
+    int bs;
+    int per;                    /* checksums per table block */
+    uint32_t *crc;              /* ntable blocks' worth, as on disk */
+    uint32_t zero_crc;          /* of a block of zeros */
+    struct crc_lanes lanes;
+    pthread_mutex_t locks[INTEGRITY_LOCKS];
+    struct blkdev_stats stats;
+};
+
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static uint32_t crc_table[256];
+static int crc_hw;
+
+static void crc_init(void)
+{
+    uint32_t c;
+    int i, k;
+
+    for (i = 0; i < 256; i++) {
+        for (c = i, k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc_table[i] = c;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    crc_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+/* the CRC register, without the initial and final inversion */
+static uint32_t crc_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    while (len-- > 0)
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+static uint32_t crc_shift(const struct crc_lanes *l, uint32_t crc)
+{
+    return l->shift[0][crc & 0xff] ^ l->shift[1][(crc >> 8) & 0xff] ^
+        l->shift[2][(crc >> 16) & 0xff] ^ l->shift[3][crc >> 24];
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw_run(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t c = crc, v;
+
+    for (; len >= 8; p += 8, len -= 8) {
+        memcpy(&v, p, 8);
+        c = __builtin_ia32_crc32di(c, v);
+    }
+    for (; len > 0; p++, len--)
+        c = __builtin_ia32_crc32qi((uint32_t)c, *p);
+    return c;
+}
+
+/* three lanes in step: each crc32 waits on the one before it in its own
+ * lane only, so the CPU keeps three going at once
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw_lanes(const struct crc_lanes *l, uint32_t crc, const unsigned char *p,
+                             size_t len)
+{
+    const unsigned char *p1 = p + l->lane, *p2 = p1 + l->lane;
+    uint64_t a = crc, b = 0, c = 0, x, y, z;
+    size_t i;
+
+    for (i = 0; i < l->lane; i += 8) {
+        memcpy(&x, p + i, 8);
+        memcpy(&y, p1 + i, 8);
+        memcpy(&z, p2 + i, 8);
+        a = __builtin_ia32_crc32di(a, x);
+        b = __builtin_ia32_crc32di(b, y);
+        c = __builtin_ia32_crc32di(c, z);
+    }
+    a = crc_shift(l, a) ^ b;
+    a = crc_shift(l, a) ^ c;
+    return crc_hw_run(a, p + 3 * l->lane, len - 3 * l->lane);
+}
+#else
+static uint32_t crc_hw_run(uint32_t crc, const unsigned char *p, size_t len)
+{
+    return crc_sw(crc, p, len);
+}
+
+static uint32_t crc_hw_lanes(const struct crc_lanes *l, uint32_t crc, const unsigned char *p,
+                             size_t len)
+{
+    return crc_sw(crc, p, len);
+}
+#endif
+
+static uint32_t crc_run(uint32_t crc, const unsigned char *p, size_t len)
+{
+    return crc_hw ? crc_hw_run(crc, p, len) : crc_sw(crc, p, len);
+}
+
+/* lanes for 'len'-byte blocks. Advancing over zeros is linear in the
+ * register, so the tables come from the 32 single-bit registers.
+ */
+static void crc_lanes_init(struct crc_lanes *l, size_t len)
+{
+    static const unsigned char zeros[4096];
+    uint32_t bit[32];
+    size_t left, n;
+    int b, k, v;
+
+    l->lane = len / 24 * 8;
+    if (!crc_hw || l->lane == 0)
+        return;
+    for (b = 0; b < 32; b++) {
+        bit[b] = 1U << b;
+        for (left = l->lane; left > 0; left -= n) {
+            n = left < sizeof(zeros) ? left : sizeof(zeros);
+            bit[b] = crc_run(bit[b], zeros, n);
+        }
+    }
+    for (k = 0; k < 4; k++)
+        for (v = 0; v < 256; v++) {
+            uint32_t c = 0;
+            for (b = 0; b < 8; b++)
+                if (v & (1 << b))
+                    c ^= bit[8 * k + b];
+            l->shift[k][v] = c;
+        }
+}
+
+static uint32_t crc_block(const struct crc_lanes *l, const void *buf, size_t len)
+{
+    if (crc_hw && l->lane > 0)
+        return ~crc_hw_lanes(l, ~0U, buf, len);
+    return ~crc_sw(~0U, buf, len);
+}
+
+/* CRC32C of 'len' bytes, carrying on from 'crc' (0 to start) */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    pthread_once(&crc_once, crc_init);
+    return ~crc_run(~crc, buf, len);
+}
+
+/* do 'nblks' data blocks, their table and the header fit in 'total'? */
+static int integrity_fits(lba_t total, int per, lba_t nblks)
+{
+    return nblks + (nblks + per - 1) / per + 1 <= total;
+}
+
+static int integrity_in_range(struct integrity_dev *id, lba_t first, lba_t n)
+{
+    return first >= 0 && n >= 0 && first <= id->nblks - n;
+}
+
+/* checksum 'n' blocks of 'buf' into 'out' */
+static void integrity_sum(struct integrity_dev *id, const char *buf, lba_t n, uint32_t *out)
+{
+    lba_t i;
+    for (i = 0; i < n; i++)
+        out[i] = crc_block(&id->lanes, buf + (size_t)i * id->bs, id->bs);
+}
+
+/* number of blocks in 'buf' that don't match their checksums */
+static lba_t integrity_check(struct integrity_dev *id, lba_t first, lba_t n, const char *buf)
+{
+    lba_t i, bad = 0;
+    for (i = 0; i < n; i++)
+        bad += crc_block(&id->lanes, buf + (size_t)i * id->bs, id->bs) !=
+            __atomic_load_n(&id->crc[first + i], __ATOMIC_RELAXED);
+    return bad;
+}
+
+/* lock the table blocks covering [first, first+n), in lock order so
+ * writers can't deadlock; returns the set of locks taken
+ */
+static uint64_t integrity_lock(struct integrity_dev *id, lba_t first, lba_t n)
+{
+    uint64_t held = 0;
+    lba_t tb;
+    int i;
+
+    for (tb = first / id->per; n > 0 && tb <= (first + n - 1) / id->per; tb++) {
+        held |= 1ULL << (tb % INTEGRITY_LOCKS);
+        if (held == ~0ULL)
+            break;
+    }
+    for (i = 0; i < INTEGRITY_LOCKS; i++)
+        if (held & (1ULL << i))
+            pthread_mutex_lock(&id->locks[i]);
+    return held;
+}
+
+static void integrity_unlock(struct integrity_dev *id, uint64_t held)
+{
+    int i;
+    for (i = INTEGRITY_LOCKS - 1; i >= 0; i--)
+        if (held & (1ULL << i))
+            pthread_mutex_unlock(&id->locks[i]);
+}
+
+/* store checksums for [first, first+n) and write the table blocks that
+ * hold them. The caller holds their locks (integrity_lock), so the last
+ * write of a table block has every update to it.
+ */
+static int integrity_update(struct integrity_dev *id, lba_t first, lba_t n, const uint32_t *sums,
+                            int flags)
+{
+    lba_t tb, i, end = first + n;
+    int val = SUCCESS;
+
+    for (tb = first / id->per; n > 0 && tb <= (end - 1) / id->per && val == SUCCESS; tb++) {
+        lba_t lo = tb * id->per > first ? tb * id->per : first;
+        lba_t hi = (tb + 1) * id->per < end ? (tb + 1) * id->per : end;
+
+        for (i = lo; i < hi; i++)
+            __atomic_store_n(&id->crc[i], sums ? sums[i - first] : id->zero_crc,
+                             __ATOMIC_RELAXED);
+        val = blkdev_write_flags(id->dev, id->table + tb, 1, id->crc + tb * id->per, flags);
+    }
+    return val;
+}
+
+/* a block that fails is read again once, in case a write to it was
+ * between its data and its checksum the first time
+ */
+static int integrity_read_blocks(struct blkdev *dev, lba_t first_blk, lba_t num_blks, void *buf)
+{
+    struct integrity_dev *id = dev->private;
+    lba_t bad;
+    int val;
+
+    assert(id->magic == INTEGRITY_DEV_MAGIC);
+    if (!integrity_in_range(id, first_blk, num_blks))
+        return E_BADADDR;
+    val = id->dev->ops->read(id->dev, first_blk, num_blks, buf);
+    if (val != SUCCESS || integrity_check(id, first_blk, num_blks, buf) == 0)
+        return val;
+    val = id->dev->ops->read(id->dev, first_blk, num_blks, buf);
+    if (val != SUCCESS || (bad = integrity_check(id, first_blk, num_blks, buf)) == 0)
+        return val;
+    blkdev_stats_add(&id->stats.csum_errors, bad);
+    return E_CORRUPT;
+}
+
+static int integrity_write_blocks(struct blkdev *dev, lba_t first_blk, lba_t num_blks, void *buf,
+                                  int flags)
+{
+    struct integrity_dev *id = dev->private;
+    uint32_t *sums;
+    uint64_t held;
+    int val;
+
+    assert(id->magic == INTEGRITY_DEV_MAGIC);
+    if (!integrity_in_range(id, first_blk, num_blks))
+        return E_BADADDR;
+    sums = malloc((num_blks + 1) * sizeof(*sums));
+    if (sums == NULL)
+        return E_UNAVAIL;
+    integrity_sum(id, buf, num_blks, sums);
+    held = integrity_lock(id, first_blk, num_blks);
+    val = blkdev_write_flags(id->dev, first_blk, num_blks, buf, flags);
+    if (val == SUCCESS)
+        val = integrity_update(id, first_blk, num_blks, sums, flags);
+    integrity_unlock(id, held);
+    free(sums);
+    return val;
+}
+
+static int integrity_write_zeroes_blocks(struct blkdev *dev, lba_t first_blk, lba_t num_blks)
+{
+    struct integrity_dev *id = dev->private;
+    uint64_t held;
+    int val;
+
+    if (!integrity_in_range(id, first_blk, num_blks))
+        return E_BADADDR;
+    held = integrity_lock(id, first_blk, num_blks);
+    val = blkdev_write_zeroes(id->dev, first_blk, num_blks);
+    if (val == SUCCESS)
+        val = integrity_update(id, first_blk, num_blks, NULL, 0);
+    integrity_unlock(id, held);
+    return val;
+}
+
+static lba_t integrity_num_blocks(struct blkdev *dev)
+{
+    struct integrity_dev *id = dev->private;
+    return id->nblks;
+}
+
+static int integrity_block_size(struct blkdev *dev)
+{
+    struct integrity_dev *id = dev->private;
+    return id->bs;
+}
+
+static int integrity_read(struct blkdev *dev, lba_t first_blk, lba_t num_blks, void *buf)
+{
+    struct integrity_dev *id = dev->private;
+    unsigned long t0 = blkdev_stats_start();
+    int val = integrity_read_blocks(dev, first_blk, num_blks, buf);
+    blkdev_stats_end(&id->stats, BLKDEV_OP_READ, num_blks, val, t0);
+    return val;
+}
+
+static int integrity_write_flags(struct blkdev *dev, lba_t first_blk, lba_t num_blks, void *buf,
+                                 int flags)
+{
+    struct integrity_dev *id = dev->private;
+    unsigned long t0 = blkdev_stats_start();
+    int val = integrity_write_blocks(dev, first_blk, num_blks, buf, flags);
+    blkdev_stats_end(&id->stats, BLKDEV_OP_WRITE, num_blks, val, t0);
+    return val;
+}
+
+static int integrity_write(struct blkdev *dev, lba_t first_blk, lba_t num_blks, void *buf)
+{
+    return integrity_write_flags(dev, first_blk, num_blks, buf, 0);
+}
+
+static int integrity_write_zeroes(struct blkdev *dev, lba_t first_blk, lba_t num_blks)
+{
+    struct integrity_dev *id = dev->private;
+    unsigned long t0 = blkdev_stats_start();
+    int val = integrity_write_zeroes_blocks(dev, first_blk, num_blks);
+    blkdev_stats_end(&id->stats, BLKDEV_OP_WRITE_ZEROES, num_blks, val, t0);
+    return val;
+}
+
+static int integrity_flush(struct blkdev *dev)
+{
+    struct integrity_dev *id = dev->private;
+    unsigned long t0 = blkdev_stats_start();
+    int val = blkdev_flush(id->dev);
+    blkdev_stats_end(&id->stats, BLKDEV_OP_FLUSH, 0, val, t0);
+    return val;
+}
+
+/* holes read as zeros, and a zero block's checksum is what format and
+ * write_zeroes store for them
+ */
+static int integrity_map_extent(struct blkdev *dev, lba_t first_blk, lba_t num_blks, lba_t *len)
+{
+    struct integrity_dev *id = dev->private;
+
+    if (!integrity_in_range(id, first_blk, num_blks))
+        return E_BADADDR;
+    return blkdev_map_extent(id->dev, first_blk, num_blks, len);
+}
+
+static struct blkdev_stats *integrity_stats(struct blkdev *dev)
+{
+    struct integrity_dev *id = dev->private;
+    return &id->stats;
+}
+
+static int integrity_members(struct blkdev *dev, struct blkdev **out, int max)
+{
+    struct integrity_dev *id = dev->private;
+    if (max < 1)
+        return 0;
+    out[0] = id->dev;
+    return 1;
+}
+
+static void integrity_close(struct blkdev *dev)
+{
+    struct integrity_dev *id = dev->private;
+    int i;
+
+    assert(id->magic == INTEGRITY_DEV_MAGIC);
+    id->dev->ops->close(id->dev);
+    for (i = 0; i < INTEGRITY_LOCKS; i++)
+        pthread_mutex_destroy(&id->locks[i]);
+    free(id->crc);
+    free(id);
+    free(dev);
+}
+
+/* no discard: a discarded block's contents are unspecified, and would no
+ * longer match its checksum
+ */
+struct blkdev_ops integrity_ops = {
+    .num_blocks = integrity_num_blocks,
+    .read = integrity_read,
+    .write = integrity_write,
+    .close = integrity_close,
+    .stats = integrity_stats,
+    .members = integrity_members,
+    .block_size = integrity_block_size,
+    .write_zeroes = integrity_write_zeroes,
+    .flush = integrity_flush,
+    .write_flags = integrity_write_flags,
+    .map_extent = integrity_map_extent,
+    .name = "integrity"
+};
+
+/* load the table if the header matches this layout, 1 if it did */
+static int integrity_load(struct integrity_dev *id, char *blk)
+{
+    struct integrity_header h;
+
+    if (id->dev->ops->read(id->dev, id->table + id->ntable, 1, blk) != SUCCESS)
+        return 0;
+    memcpy(&h, blk, sizeof(h));
+    if (h.magic != INTEGRITY_MAGIC || h.bs != (uint32_t)id->bs || h.nblks != id->nblks ||
+        h.crc != crc32c(0, &h, offsetof(struct integrity_header, crc)))
+        return 0;
+    return id->dev->ops->read(id->dev, id->table, id->ntable, id->crc) == SUCCESS;
+}
+
+/* checksum everything on the device, then write the table and, once
+ * that is durable, the header
+ */
+static int integrity_format(struct integrity_dev *id, char *blk)
+{
+    struct integrity_header h;
+    char *buf = malloc((size_t)INTEGRITY_CHUNK * id->bs);
+    lba_t i, n;
+    int val = SUCCESS;
+
+    if (buf == NULL)
+        return E_UNAVAIL;
+    for (i = 0; i < id->nblks && val == SUCCESS; i += n) {
+        n = id->nblks - i < INTEGRITY_CHUNK ? id->nblks - i : INTEGRITY_CHUNK;
+        val = id->dev->ops->read(id->dev, i, n, buf);
+        integrity_sum(id, buf, n, id->crc + i);
+    }
+    free(buf);
+    if (val == SUCCESS)
+        val = blkdev_write_flags(id->dev, id->table, id->ntable, id->crc, BLKDEV_FUA);
+    if (val != SUCCESS)
+        return val;
+
+    memset(&h, 0, sizeof(h));
+    h.magic = INTEGRITY_MAGIC;
+    h.bs = id->bs;
+    h.nblks = id->nblks;
+    h.crc = crc32c(0, &h, offsetof(struct integrity_header, crc));
+    memset(blk, 0, id->bs);
+    memcpy(blk, &h, sizeof(h));
+    return blkdev_write_flags(id->dev, id->table + id->ntable, 1, blk, BLKDEV_FUA);
+}
+
+/* create an integrity layer over 'dev', which it closes on close. The
+ * checksums take 4 bytes a block plus a header block off the end.
+ */
+struct blkdev *integrity_create(struct blkdev *dev)
+{
+    struct blkdev *idev;
+    struct integrity_dev *id;
+    lba_t total;
+    char *blk;
+    int i;
+
+    if (dev == NULL)
+        return NULL;
+    pthread_once(&crc_once, crc_init);
+
+    idev = malloc(sizeof(*idev));
+    id = calloc(1, sizeof(*id));
+    if (idev == NULL || id == NULL) {
+        free(idev);
+        free(id);
+        return NULL;
+    }
+
+    id->magic = INTEGRITY_DEV_MAGIC;
+    id->dev = dev;
+    id->bs = blkdev_block_size(dev);
+    id->per = id->bs / sizeof(uint32_t);
+    total = dev->ops->num_blocks(dev);
+    id->nblks = total > 1 ? (total - 1) / (id->per + 1) * id->per : 0;
+    while (integrity_fits(total, id->per, id->nblks + 1))
+        id->nblks++;
+    id->ntable = (id->nblks + id->per - 1) / id->per;
+    id->table = id->nblks;
+    if (id->nblks < 1) {
+        fprintf(stderr, "integrity: device of %lld blocks is too small\n", (long long)total);
+        free(idev);
+        free(id);
+        return NULL;
+    }
+
+    id->crc = calloc(id->ntable, id->bs);
+    blk = calloc(1, id->bs);
+    if (id->crc == NULL || blk == NULL) {
+        free(blk);
+        free(id->crc);
+        free(idev);
+        free(id);
+        return NULL;
+    }
+    crc_lanes_init(&id->lanes, id->bs);
+    id->zero_crc = crc_block(&id->lanes, blk, id->bs);
+    if (!integrity_load(id, blk) && integrity_format(id, blk) != SUCCESS) {
+        fprintf(stderr, "integrity: can't write checksums\n");
+        free(blk);
+        free(id->crc);
+        free(idev);
+        free(id);
+        return NULL;
+    }
+    free(blk);
+    for (i = 0; i < INTEGRITY_LOCKS; i++)
+        pthread_mutex_init(&id->locks[i], NULL);
+
+    idev->private = id;
+    idev->ops = &integrity_ops;
+    return idev;
+}
@@ -1,133 +1,526 @@
-#include "blkdev.h"
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <assert.h>
-#include <time.h>
-
-/* Write some data to an area of memory */
-void write_data(char *data, int length)
-{
-    for (int i = 0; i < length; i++)
-    {
-        data[i] = (char)i;
-    }
-}
-
-/* Create a new file ready to be used as an image. Every byte of the file will be zero. */
-struct blkdev *create_new_image(char *path, int blocks)
-{
-    if (blocks < 1)
-    {
-        printf("create_new_image: error - blocks must be at least 1: %d\n", blocks);
-        return NULL;
-    }
-    FILE *image = fopen(path, "w");
-    /* This is a trick: instead of writing every byte from 0 to N we can instead move the file cursor
-     * directly to N-1 and then write 1 byte. The filesystem will fill in the rest of the bytes with
-     * zero for us.
-     */
-    fseek(image, blocks * BLOCK_SIZE - 1, SEEK_SET);
-    char c = 0;
-    fwrite(&c, 1, 1, image);
-    fclose(image);
-
-    return image_create(path);
-}
-
-/* Write a buffer to a file for debugging purposes */
-void dump(char *buffer, int length, char *path)
-{
-    FILE *output = fopen(path, "w");
-    fwrite(buffer, 1, length, output);
-    fclose(output);
-}
-
-int main()
-{
-    struct blkdev *mirror_drives[2];
-    /* Create two images for the mirror */
-    mirror_drives[0] = create_new_image("mirror1", 2);
-    mirror_drives[1] = create_new_image("mirror2", 2);
-    /* Create the raid mirror */
-    struct blkdev *mirror = mirror_create(mirror_drives);
-
-    /* Write some data to the mirror, then read the data back and check that the
-     * two buffers contain the same bytes.
-     */
-    char write_buffer[BLOCK_SIZE];
-    write_data(write_buffer, BLOCK_SIZE);
-    if (blkdev_write(mirror, 0, 1, write_buffer) != SUCCESS)
-    {
-        printf("Write failed!\n");
-        exit(0);
-    }
-
-    char read_buffer[BLOCK_SIZE];
-    /* Zero out the buffer to make sure blkdev_read() actually does something */
-    bzero(read_buffer, BLOCK_SIZE);
-
-    if (blkdev_read(mirror, 0, 1, read_buffer) != SUCCESS)
-    {
-        printf("Read failed!\n");
-        exit(0);
-    }
-
-    /* For debugging, you can analyze these files manually */
-    dump(write_buffer, BLOCK_SIZE, "write-buffer");
-    dump(read_buffer, BLOCK_SIZE, "read-buffer");
-
-    if (memcmp(write_buffer, read_buffer, BLOCK_SIZE) != 0)
-    {
-        printf("Read doesn't match write!\n");
-    }
-    else
-    {
-        printf("Mirror test passed\n");
-    }
-
-    /* Your tests here */
-    char buffer0[BLOCK_SIZE * 2];
-    char buffer1[BLOCK_SIZE * 2];
-    srand(time(NULL));
-    write_data(buffer1, 2 * BLOCK_SIZE);
-    assert(blkdev_write(mirror, 0, 2, buffer1) == SUCCESS);
-    assert(mirror != NULL);
-    int num_blocks = mirror->ops->num_blocks(mirror);
-    assert(num_blocks == mirror_drives[0]->ops->num_blocks(mirror_drives[0]));
-    char backup[BLOCK_SIZE * num_blocks];
-    char copy[BLOCK_SIZE * num_blocks];
-    bzero(backup, BLOCK_SIZE * num_blocks);
-    bzero(copy, BLOCK_SIZE * num_blocks);
-    //overwrite mirror with 0
-    assert(blkdev_write(mirror, 0, num_blocks, backup) == SUCCESS);
-    for (int i = 0; i < 7 * num_blocks; i++)
-    {
-        int start = rand() % num_blocks;
-        assert(blkdev_write(mirror, start, 1, write_buffer) == SUCCESS);
-        memcpy(backup + start * BLOCK_SIZE, write_buffer, BLOCK_SIZE);
-        assert(blkdev_read(mirror, start, 1, read_buffer) == SUCCESS);
-        assert(memcmp(write_buffer, read_buffer, BLOCK_SIZE) == 0);
-        bzero(read_buffer, BLOCK_SIZE);
-    }
-    assert(blkdev_read(mirror, 0, num_blocks, copy) == SUCCESS);
-    dump(copy, BLOCK_SIZE * num_blocks, "copy");
-    dump(backup, BLOCK_SIZE * num_blocks, "backup");
-    assert(memcmp(backup, copy, BLOCK_SIZE * num_blocks) == 0);
-
-    //when one of the disks fail
-    image_fail(mirror_drives[0]);
-    assert(blkdev_read(mirror_drives[0], 0, 2, buffer0) != SUCCESS);
-    assert(blkdev_read(mirror, 0, 2, buffer0) == SUCCESS);
-    assert(memcmp(buffer0, buffer1, BLOCK_SIZE * 2) == 0);
-
-    //replace
-    struct blkdev *new_disk = create_new_image("new_disk", 2);
-    assert(mirror_replace(mirror, 0, new_disk) == SUCCESS);
-    assert(blkdev_read(new_disk, 0, 2, buffer0) == SUCCESS);
-    assert(blkdev_read(mirror_drives[1], 0, 2, buffer1) == SUCCESS);
-    assert(memcmp(buffer0, buffer1, BLOCK_SIZE * 2) == 0);
-
-    printf("Mirror test passed\n\n");
-}
+#include "blkdev.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+
+static void *flush_thread(void *dev)
+{
+    assert(blkdev_flush(dev) == SUCCESS);
+    return NULL;
+}
+
+/* slow member events, in order */
+static int events[8], nevents;
+
+static void slow_event(void *arg, struct blkdev *volume, int member, int event,
+                       unsigned long member_ns, unsigned long peer_ns)
+{
+    assert(member == 0 && member_ns > peer_ns);
+    if (nevents < 8)
+        events[nevents++] = event;
+}
+
+/* foreground I/O for the rebuild throttling tests, until 'stop' is set */
+static volatile int stop;
+static unsigned long fg_writes;
+
+static void *fg_reader(void *mirror)
+{
+    char buf[BLOCK_SIZE];
+    for (int i = 0; !stop; i++)
+        assert(blkdev_read(mirror, i % 512, 1, buf) == SUCCESS);
+    return NULL;
+}
+
+static void *fg_writer(void *mirror)
+{
+    char buf[BLOCK_SIZE];
+    for (unsigned long i = 0; !stop; i++) {
+        memset(buf, (int)i, BLOCK_SIZE);
+        assert(blkdev_write(mirror, (i * 97) % 512, 1, buf) == SUCCESS);
+        fg_writes++;
+    }
+    return NULL;
+}
+
+/* Write some data to an area of memory */
+void write_data(char *data, int length)
+{
+    for (int i = 0; i < length; i++)
+    {
+        data[i] = (char)i;
+    }
+}
+
+/* Create a new file ready to be used as an image. Every byte of the file will be zero. */
+struct blkdev *create_new_image(char *path, int blocks)
+{
+    if (blocks < 1)
+    {
+        printf("create_new_image: error - blocks must be at least 1: %d\n", blocks);
+        return NULL;
+    }
+    FILE *image = fopen(path, "w");
+    /* This is a trick: instead of writing every byte from 0 to N we can instead move the file cursor
+     * directly to N-1 and then write 1 byte. The filesystem will fill in the rest of the bytes with
+     * zero for us.
+     */
+    fseek(image, blocks * BLOCK_SIZE - 1, SEEK_SET);
+    char c = 0;
+    fwrite(&c, 1, 1, image);
+    fclose(image);
+
+    return image_create(path);
+}
+
+/* Write a buffer to a file for debugging purposes */
+void dump(char *buffer, int length, char *path)
+{
+    FILE *output = fopen(path, "w");
+    fwrite(buffer, 1, length, output);
+    fclose(output);
+}
+
+int main()
+{
+    struct blkdev *mirror_drives[2];
+    /* Create two images for the mirror */
+    mirror_drives[0] = create_new_image("mirror1", 2);
+    mirror_drives[1] = create_new_image("mirror2", 2);
+    /* Create the raid mirror */
+    struct blkdev *mirror = mirror_create(mirror_drives);
+
+    /* Write some data to the mirror, then read the data back and check that the
+     * two buffers contain the same bytes.
+     */
+    char write_buffer[BLOCK_SIZE];
+    write_data(write_buffer, BLOCK_SIZE);
+    if (blkdev_write(mirror, 0, 1, write_buffer) != SUCCESS)
+    {
+        printf("Write failed!\n");
+        exit(0);
+    }
+
+    char read_buffer[BLOCK_SIZE];
+    /* Zero out the buffer to make sure blkdev_read() actually does something */
+    bzero(read_buffer, BLOCK_SIZE);
+
+    if (blkdev_read(mirror, 0, 1, read_buffer) != SUCCESS)
+    {
+        printf("Read failed!\n");
+        exit(0);
+    }
+
+    /* For debugging, you can analyze these files manually */
+    dump(write_buffer, BLOCK_SIZE, "write-buffer");
+    dump(read_buffer, BLOCK_SIZE, "read-buffer");
+
+    if (memcmp(write_buffer, read_buffer, BLOCK_SIZE) != 0)
+    {
+        printf("Read doesn't match write!\n");
+    }
+    else
+    {
+        printf("Mirror test passed\n");
+    }
+
+    /* Your tests here */
+    char buffer0[BLOCK_SIZE * 2];
+    char buffer1[BLOCK_SIZE * 2];
+    srand(time(NULL));
+    write_data(buffer1, 2 * BLOCK_SIZE);
+    assert(blkdev_write(mirror, 0, 2, buffer1) == SUCCESS);
+    assert(mirror != NULL);
+    int num_blocks = mirror->ops->num_blocks(mirror);
+    assert(num_blocks == mirror_drives[0]->ops->num_blocks(mirror_drives[0]));
+    char backup[BLOCK_SIZE * num_blocks];
+    char copy[BLOCK_SIZE * num_blocks];
+    bzero(backup, BLOCK_SIZE * num_blocks);
+    bzero(copy, BLOCK_SIZE * num_blocks);
+    //overwrite mirror with 0
+    assert(blkdev_write(mirror, 0, num_blocks, backup) == SUCCESS);
+    for (int i = 0; i < 7 * num_blocks; i++)
+    {
+        int start = rand() % num_blocks;
+        assert(blkdev_write(mirror, start, 1, write_buffer) == SUCCESS);
+        memcpy(backup + start * BLOCK_SIZE, write_buffer, BLOCK_SIZE);
+        assert(blkdev_read(mirror, start, 1, read_buffer) == SUCCESS);
+        assert(memcmp(write_buffer, read_buffer, BLOCK_SIZE) == 0);
+        bzero(read_buffer, BLOCK_SIZE);
+    }
+    assert(blkdev_read(mirror, 0, num_blocks, copy) == SUCCESS);
+    dump(copy, BLOCK_SIZE * num_blocks, "copy");
+    dump(backup, BLOCK_SIZE * num_blocks, "backup");
+    assert(memcmp(backup, copy, BLOCK_SIZE * num_blocks) == 0);
+
+    //when one of the disks fail
+    image_fail(mirror_drives[0]);
+    assert(blkdev_read(mirror_drives[0], 0, 2, buffer0) != SUCCESS);
+    assert(blkdev_read(mirror, 0, 2, buffer0) == SUCCESS);
+    assert(memcmp(buffer0, buffer1, BLOCK_SIZE * 2) == 0);
+
+    //replace
+    struct blkdev *new_disk = create_new_image("new_disk", 2);
+    assert(mirror_replace(mirror, 0, new_disk) == SUCCESS);
+    assert(blkdev_read(new_disk, 0, 2, buffer0) == SUCCESS);
+    assert(blkdev_read(mirror_drives[1], 0, 2, buffer1) == SUCCESS);
+    assert(memcmp(buffer0, buffer1, BLOCK_SIZE * 2) == 0);
+
+    blkdev_close(mirror);
+
+    //discard: whole regions are discarded on both sides, read back as zeros
+    //and are skipped (not copied) by replace
+    int nblks = 256;
+    mirror_drives[0] = create_new_image("mirror1", nblks);
+    mirror_drives[1] = create_new_image("mirror2", nblks);
+    mirror = mirror_create(mirror_drives);
+    char *big = malloc(BLOCK_SIZE * nblks), *big_copy = malloc(BLOCK_SIZE * nblks);
+    write_data(big, BLOCK_SIZE * nblks);
+    for (int i = 0; i < nblks; i++)
+        big[i * BLOCK_SIZE] = (char)(i + 1);
+    assert(blkdev_write(mirror, 0, nblks, big) == SUCCESS);
+    assert(blkdev_discard(mirror, 60, 140) == SUCCESS);
+    memset(big + 64 * BLOCK_SIZE, 0, 128 * BLOCK_SIZE);
+    assert(blkdev_discard(mirror, nblks, 1) == E_BADADDR);
+
+    //a write brings a discarded region back into the rebuild
+    assert(blkdev_write(mirror, 130, 1, write_buffer) == SUCCESS);
+    memcpy(big + 130 * BLOCK_SIZE, write_buffer, BLOCK_SIZE);
+
+    image_fail(mirror_drives[0]);
+    new_disk = create_new_image("new_disk", nblks);
+    assert(mirror_replace(mirror, 0, new_disk) == SUCCESS);
+    struct blkdev_stats st;
+    assert(blkdev_get_stats(mirror, &st) == SUCCESS);
+    assert(st.rebuild_skipped >= 64 && st.rebuild_skipped + st.rebuilt == 256);
+    assert(st.op[BLKDEV_OP_DISCARD].ops == 2 && st.op[BLKDEV_OP_DISCARD].errors == 1);
+
+    //the rebuilt side alone holds everything that wasn't discarded
+    image_fail(mirror_drives[1]);
+    assert(blkdev_read(mirror, 0, nblks, big_copy) == SUCCESS);
+    assert(memcmp(big, big_copy, 60 * BLOCK_SIZE) == 0);
+    assert(memcmp(big + 200 * BLOCK_SIZE, big_copy + 200 * BLOCK_SIZE, 56 * BLOCK_SIZE) == 0);
+    assert(memcmp(big + 130 * BLOCK_SIZE, big_copy + 130 * BLOCK_SIZE, BLOCK_SIZE) == 0);
+    blkdev_close(mirror);
+    free(big);
+    free(big_copy);
+
+    //a thinly used mirror: holes on the surviving side aren't copied, and
+    //the new side ends up with the same data
+    nblks = 1024;
+    mirror_drives[0] = create_new_image("mirror1", nblks);
+    mirror_drives[1] = create_new_image("mirror2", nblks);
+    mirror = mirror_create(mirror_drives);
+    big = malloc(BLOCK_SIZE * nblks);
+    big_copy = malloc(BLOCK_SIZE * nblks);
+    write_data(big, BLOCK_SIZE * 8);
+    assert(blkdev_write(mirror, 512, 8, big) == SUCCESS);
+    image_fail(mirror_drives[0]);
+    new_disk = create_new_image("new_disk", nblks);
+    assert(mirror_replace(mirror, 0, new_disk) == SUCCESS);
+    assert(blkdev_get_stats(mirror, &st) == SUCCESS);
+    assert(st.rebuilt < 64 && st.rebuild_skipped + st.rebuilt == nblks);
+    assert(blkdev_read(mirror_drives[1], 0, nblks, big) == SUCCESS);
+    assert(blkdev_read(new_disk, 0, nblks, big_copy) == SUCCESS);
+    assert(memcmp(big, big_copy, BLOCK_SIZE * nblks) == 0);
+    blkdev_close(mirror);
+    free(big);
+    free(big_copy);
+
+    //copy_range between images, and from a device that isn't an image
+    struct blkdev *img_a = create_new_image("mirror1", 16), *img_b = create_new_image("mirror2", 16);
+    big = malloc(BLOCK_SIZE * 16);
+    big_copy = malloc(BLOCK_SIZE * 16);
+    write_data(big, BLOCK_SIZE * 16);
+    for (int i = 0; i < 16; i++)
+        big[i * BLOCK_SIZE] = (char)(i + 1);
+    assert(blkdev_write(img_a, 0, 16, big) == SUCCESS);
+    assert(blkdev_copy_range(img_b, 4, img_a, 2, 9) == SUCCESS);
+    assert(blkdev_read(img_b, 4, 9, big_copy) == SUCCESS);
+    assert(memcmp(big + 2 * BLOCK_SIZE, big_copy, 9 * BLOCK_SIZE) == 0);
+    assert(blkdev_copy_range(img_b, 8, img_a, 0, 9) == E_BADADDR);
+    struct blkdev *ra = readahead_create(img_a, 4, 16);
+    assert(blkdev_copy_range(img_b, 0, ra, 7, 3) == SUCCESS);
+    assert(blkdev_read(img_b, 0, 3, big_copy) == SUCCESS);
+    assert(memcmp(big + 7 * BLOCK_SIZE, big_copy, 3 * BLOCK_SIZE) == 0);
+    blkdev_close(ra);
+    blkdev_close(img_b);
+    free(big);
+    free(big_copy);
+
+    //flush reaches both sides; FUA writes are durable as they complete, and
+    //concurrent flushes all succeed while sharing member flushes
+    mirror_drives[0] = create_new_image("mirror1", 2);
+    mirror_drives[1] = create_new_image("mirror2", 2);
+    mirror = mirror_create(mirror_drives);
+    assert(blkdev_write_flags(mirror, 0, 1, write_buffer, BLKDEV_FUA) == SUCCESS);
+    assert(blkdev_read(mirror_drives[1], 0, 1, read_buffer) == SUCCESS);
+    assert(memcmp(read_buffer, write_buffer, BLOCK_SIZE) == 0);
+    pthread_t flushers[8];
+    for (int i = 0; i < 8; i++)
+        assert(pthread_create(&flushers[i], NULL, flush_thread, mirror) == 0);
+    for (int i = 0; i < 8; i++)
+        pthread_join(flushers[i], NULL);
+    assert(blkdev_get_stats(mirror, &st) == SUCCESS);
+    assert(st.op[BLKDEV_OP_FLUSH].ops == 8 && st.op[BLKDEV_OP_FLUSH].errors == 0);
+    assert(blkdev_get_stats(mirror_drives[0], &st) == SUCCESS);
+    assert(st.op[BLKDEV_OP_FLUSH].ops >= 1 && st.op[BLKDEV_OP_FLUSH].ops <= 8);
+
+    //a side that can't flush is failed, the other side carries on
+    image_fail(mirror_drives[0]);
+    assert(blkdev_flush(mirror) == SUCCESS);
+    assert(blkdev_write_flags(mirror, 1, 1, write_buffer, BLKDEV_FUA) == SUCCESS);
+    blkdev_close(mirror);
+
+    //hedged reads: a slow side doesn't hold reads up once they hedge
+    struct sim_params sp;
+    memset(&sp, 0, sizeof(sp));
+    mirror_drives[0] = sim_create(ramdisk_create(64), &sp);
+    mirror_drives[1] = ramdisk_create(64);
+    mirror = mirror_create(mirror_drives);
+    assert(blkdev_write(mirror, 0, 1, write_buffer) == SUCCESS);
+    sp.lat_ns = 50000000;
+    sim_configure(mirror_drives[0], &sp);
+    unsigned long t0 = blkdev_stats_start();
+    assert(blkdev_read(mirror, 0, 1, read_buffer) == SUCCESS);
+    assert(blkdev_stats_start() - t0 >= 50000000);
+    mirror_set_hedge(mirror, 2000000);
+    t0 = blkdev_stats_start();
+    bzero(read_buffer, BLOCK_SIZE);
+    assert(blkdev_read(mirror, 0, 1, read_buffer) == SUCCESS);
+    assert(blkdev_stats_start() - t0 < 40000000);
+    assert(memcmp(read_buffer, write_buffer, BLOCK_SIZE) == 0);
+    assert(blkdev_get_stats(mirror, &st) == SUCCESS);
+    assert(st.hedged_reads == 1 && st.hedge_wins == 1);
+
+    //the p95 budget needs a history, then catches a side that turns slow
+    sp.lat_ns = 0;
+    sim_configure(mirror_drives[0], &sp);
+    mirror_set_hedge(mirror, MIRROR_HEDGE_P95);
+    for (int i = 0; i < 100; i++)
+        assert(blkdev_read(mirror, i % 64, 1, read_buffer) == SUCCESS);
+    assert(blkdev_get_stats(mirror, &st) == SUCCESS);
+    assert(st.hedged_reads == 1);
+    sp.lat_ns = 50000000;
+    sim_configure(mirror_drives[0], &sp);
+    t0 = blkdev_stats_start();
+    assert(blkdev_read(mirror, 0, 1, read_buffer) == SUCCESS);
+    assert(blkdev_stats_start() - t0 < 40000000);
+    assert(memcmp(read_buffer, write_buffer, BLOCK_SIZE) == 0);
+
+    //a failing first side falls over to the other without waiting; the
+    //read repair can't write it either, so it is failed and the next
+    //read is degraded
+    sp.lat_ns = 0;
+    sp.error_prob = 1;
+    sim_configure(mirror_drives[0], &sp);
+    assert(blkdev_read(mirror, 0, 1, read_buffer) == SUCCESS);
+    assert(memcmp(read_buffer, write_buffer, BLOCK_SIZE) == 0);
+    assert(blkdev_get_stats(mirror, &st) == SUCCESS);
+    assert(st.degraded_reads == 0 && st.read_repairs == 0);
+    assert(blkdev_read(mirror, 0, 1, read_buffer) == SUCCESS);
+    assert(blkdev_get_stats(mirror, &st) == SUCCESS);
+    assert(st.degraded_reads == 1);
+    blkdev_close(mirror);
+
+    //a read error that a write clears is repaired in place: the side
+    //stays in, and holds the other side's data again
+    //(seed 2: the first op fails, the two after it don't)
+    memset(&sp, 0, sizeof(sp));
+    sp.error_prob = 0.5;
+    sp.seed = 2;
+    mirror_drives[0] = sim_create(ramdisk_create(64), &sp);
+    mirror_drives[1] = ramdisk_create(64);
+    assert(blkdev_write(mirror_drives[1], 0, 1, write_buffer) == SUCCESS);
+    mirror = mirror_create(mirror_drives);
+    assert(blkdev_read(mirror, 0, 1, read_buffer) == SUCCESS);
+    assert(memcmp(read_buffer, write_buffer, BLOCK_SIZE) == 0);
+    assert(blkdev_get_stats(mirror, &st) == SUCCESS);
+    assert(st.read_repairs == 1 && st.degraded_reads == 0);
+    assert(blkdev_read(mirror_drives[0], 0, 1, read_buffer) == SUCCESS);
+    assert(memcmp(read_buffer, write_buffer, BLOCK_SIZE) == 0);
+    blkdev_close(mirror);
+
+    //a read error on the only copy fails a rebuild from it, but the
+    //side stays in
+    struct blkdev *only = ramdisk_create(64);
+    for (int i = 0; i < 64; i++)
+        assert(blkdev_write(only, i, 1, write_buffer) == SUCCESS);
+    memset(&sp, 0, sizeof(sp));
+    sp.bad_first = 5;
+    sp.bad_blocks = 1;
+    mirror_drives[0] = NULL;
+    mirror_drives[1] = sim_create(only, &sp);
+    mirror = mirror_create(mirror_drives);
+    assert(mirror_replace(mirror, 0, ramdisk_create(64)) == E_UNAVAIL);
+    assert(blkdev_read(mirror, 0, 1, read_buffer) == SUCCESS);
+    assert(memcmp(read_buffer, write_buffer, BLOCK_SIZE) == 0);
+    blkdev_close(mirror);
+
+    //a side that stays much slower than the other is ejected
+    memset(&sp, 0, sizeof(sp));
+    sp.lat_ns = 200000;
+    mirror_drives[0] = sim_create(ramdisk_create(64), &sp);
+    mirror_drives[1] = ramdisk_create(64);
+    mirror = mirror_create(mirror_drives);
+    assert(blkdev_write(mirror, 0, 1, write_buffer) == SUCCESS);
+    struct raid_slow_policy policy = {.action = RAID_SLOW_EJECT, .strikes = 2,
+                                      .event = slow_event};
+    assert(raid_set_slow_policy(mirror, &policy) == SUCCESS);
+    for (int i = 0; i < 1000 && nevents < 2; i++)
+        assert(blkdev_read(mirror, 0, 1, read_buffer) == SUCCESS);
+    assert(nevents == 2 && events[0] == RAID_EVENT_SLOW && events[1] == RAID_EVENT_EJECTED);
+    assert(blkdev_get_stats(mirror, &st) == SUCCESS);
+    unsigned long degraded = st.degraded_reads;
+    assert(blkdev_read(mirror, 0, 1, read_buffer) == SUCCESS);
+    assert(memcmp(read_buffer, write_buffer, BLOCK_SIZE) == 0);
+    assert(blkdev_get_stats(mirror, &st) == SUCCESS);
+    assert(st.degraded_reads == degraded + 1);
+    //which replace puts back in service
+    assert(mirror_replace(mirror, 0, ramdisk_create(64)) == SUCCESS);
+    blkdev_close(mirror);
+
+    //rebuild bandwidth: at 8 MB/s, the last of 256 KiB's 8 regions
+    //can't start before 28ms
+    mirror_drives[0] = ramdisk_create(512);
+    mirror_drives[1] = ramdisk_create(512);
+    mirror = mirror_create(mirror_drives);
+    char *image = malloc(512 * BLOCK_SIZE), *side = malloc(512 * BLOCK_SIZE);
+    write_data(image, 512 * BLOCK_SIZE);
+    assert(blkdev_write(mirror, 0, 512, image) == SUCCESS);
+    ramdisk_fail(mirror_drives[0]);
+    struct raid_throttle throttle = {.max_bw = 8e6};
+    assert(raid_set_throttle(mirror, RAID_PRIO_REBUILD, &throttle) == SUCCESS);
+    assert(raid_set_throttle(mirror, RAID_PRIO_FOREGROUND, &throttle) == E_BADADDR);
+    t0 = blkdev_stats_start();
+    assert(mirror_replace(mirror, 0, mirror_drives[0] = ramdisk_create(512)) == SUCCESS);
+    assert(blkdev_stats_start() - t0 >= 28000000);
+    assert(blkdev_get_stats(mirror, &st) == SUCCESS);
+    assert(st.throttled_ns > 0 && st.rebuilt == 512);
+
+    //writes during the rebuild reach the new side, wherever the copy is
+    pthread_t fg;
+    stop = 0;
+    ramdisk_fail(mirror_drives[0]);
+    assert(pthread_create(&fg, NULL, fg_writer, mirror) == 0);
+    assert(mirror_replace(mirror, 0, mirror_drives[0] = ramdisk_create(512)) == SUCCESS);
+    stop = 1;
+    pthread_join(fg, NULL);
+    assert(fg_writes > 0);
+    assert(blkdev_read(mirror_drives[0], 0, 512, image) == SUCCESS);
+    assert(blkdev_read(mirror_drives[1], 0, 512, side) == SUCCESS);
+    assert(memcmp(image, side, 512 * BLOCK_SIZE) == 0);
+    blkdev_close(mirror);
+
+    //and backs off while foreground reads are slower than the target:
+    //32 MB/s would take 32ms for 1 MiB, but it halves every 10ms down
+    //to 4 MB/s, which takes over 100ms for what's left
+    memset(&sp, 0, sizeof(sp));
+    sp.lat_ns = 200000;
+    mirror_drives[0] = ramdisk_create(2048);
+    mirror_drives[1] = sim_create(ramdisk_create(2048), &sp);
+    mirror = mirror_create(mirror_drives);
+    ramdisk_fail(mirror_drives[0]);
+    throttle.max_bw = 32e6;
+    throttle.min_bw = 4e6;
+    throttle.target_ns = 50000;
+    assert(raid_set_throttle(mirror, RAID_PRIO_REBUILD, &throttle) == SUCCESS);
+    stop = 0;
+    assert(pthread_create(&fg, NULL, fg_reader, mirror) == 0);
+    t0 = blkdev_stats_start();
+    assert(mirror_replace(mirror, 0, ramdisk_create(2048)) == SUCCESS);
+    assert(blkdev_stats_start() - t0 >= 80000000);
+    stop = 1;
+    pthread_join(fg, NULL);
+    blkdev_close(mirror);
+
+    //scrub: sides that disagree are found, and the second side repaired
+    //from the first
+    mirror_drives[0] = ramdisk_create(512);
+    mirror_drives[1] = ramdisk_create(512);
+    mirror = mirror_create(mirror_drives);
+    write_data(image, 512 * BLOCK_SIZE);
+    assert(blkdev_write(mirror, 0, 512, image) == SUCCESS);
+    memset(write_buffer, 0x5a, BLOCK_SIZE);
+    assert(blkdev_write(mirror_drives[1], 300, 1, write_buffer) == SUCCESS);
+    struct raid_scrub scrub = {0};
+    assert(raid_scrub(mirror, &scrub) == SUCCESS);
+    assert(scrub.next == 512 && scrub.checked == 512 && scrub.mismatched == 64);
+    memset(&scrub, 0, sizeof(scrub));
+    scrub.flags = RAID_SCRUB_REPAIR;
+    assert(raid_scrub(mirror, &scrub) == SUCCESS);
+    assert(scrub.repaired == 64);
+    assert(blkdev_read(mirror_drives[1], 0, 512, side) == SUCCESS);
+    assert(memcmp(image, side, 512 * BLOCK_SIZE) == 0);
+    blkdev_close(mirror);
+
+    //a hot spare takes over from a failed side by itself: one of the
+    //wrong size is refused, and one that fails is passed over
+    mirror_drives[0] = ramdisk_create(512);
+    mirror_drives[1] = ramdisk_create(512);
+    mirror = mirror_create(mirror_drives);
+    assert(blkdev_write(mirror, 0, 512, image) == SUCCESS);
+    struct blkdev *spares[2] = {ramdisk_create(512), ramdisk_create(512)};
+    struct blkdev *small = ramdisk_create(256);
+    assert(raid_add_spare(mirror, small) == E_SIZE);
+    blkdev_close(small);
+    ramdisk_fail(spares[0]);
+    assert(raid_add_spare(mirror, spares[0]) == SUCCESS);
+    assert(raid_add_spare(mirror, spares[1]) == SUCCESS);
+    assert(raid_wait_spares(mirror) == 2);
+    ramdisk_fail(mirror_drives[1]);
+    assert(blkdev_write(mirror, 0, 1, image) == SUCCESS);
+    assert(raid_wait_spares(mirror) == 0);
+    assert(blkdev_read(spares[1], 0, 512, side) == SUCCESS);
+    assert(memcmp(image, side, 512 * BLOCK_SIZE) == 0);
+    assert(blkdev_get_stats(mirror, &st) == SUCCESS);
+    degraded = st.degraded_reads;
+    assert(blkdev_read(mirror, 0, 512, side) == SUCCESS);
+    assert(blkdev_get_stats(mirror, &st) == SUCCESS && st.degraded_reads == degraded);
+    blkdev_close(mirror);
+
+    //a checkpointed rebuild stopped by close carries on from the
+    //checkpoint once the new side is handed back to the reassembled
+    //mirror: at least 4 of the 8 regions were saved, and only the one
+    //written since is copied again
+    mirror_drives[0] = create_new_image("test1", 512);
+    mirror_drives[1] = ramdisk_create(512);
+    mirror = mirror_create(mirror_drives);
+    assert(blkdev_write(mirror, 0, 512, image) == SUCCESS);
+    throttle.max_bw = 2e6;
+    throttle.min_bw = 0;
+    throttle.target_ns = 0;
+    assert(raid_set_throttle(mirror, RAID_PRIO_REBUILD, &throttle) == SUCCESS);
+    assert(raid_set_rebuild_checkpoint(mirror, 128) == SUCCESS);
+    assert(raid_add_spare(mirror, create_new_image("test2", 512)) == SUCCESS);
+    ramdisk_fail(mirror_drives[1]);
+    assert(blkdev_write(mirror, 0, 1, image) == SUCCESS);
+    do {
+        usleep(1000);
+        assert(blkdev_get_stats(mirror, &st) == SUCCESS);
+    } while (st.rebuilt < 256);
+    blkdev_close(mirror);
+    mirror_drives[0] = image_create("test1");
+    mirror_drives[1] = NULL;
+    mirror = mirror_create(mirror_drives);
+    assert(raid_set_throttle(mirror, RAID_PRIO_REBUILD, &throttle) == SUCCESS);
+    assert(raid_add_spare(mirror, image_create("test2")) == SUCCESS);
+    memset(image + 10 * BLOCK_SIZE, 0x5a, BLOCK_SIZE);
+    assert(blkdev_write(mirror, 10, 1, image + 10 * BLOCK_SIZE) == SUCCESS);
+    assert(raid_wait_spares(mirror) == 0);
+    assert(blkdev_get_stats(mirror, &st) == SUCCESS);
+    assert(st.rebuilt <= 320);
+    blkdev_close(mirror);
+    struct blkdev *done = image_create("test2");
+    assert(blkdev_read(done, 0, 512, side) == SUCCESS);
+    assert(memcmp(image, side, 512 * BLOCK_SIZE) == 0);
+    blkdev_close(done);
+    free(image);
+    free(side);
+
+    printf("Mirror test passed\n\n");
+}
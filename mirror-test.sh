@@ -1,2 +1 @@
-gcc -g -w -o mirror-test mirror-test.c image.c homework.c && ./mirror-test
-
+gcc -g -w -pthread -o mirror-test mirror-test.c image.c ramdisk.c sim.c raid.c integrity.c readahead.c -lm && ./mirror-test
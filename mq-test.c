@@ -0,0 +1,141 @@
+#include "blkdev.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+
+#define NDISKS   4
+#define UNIT     8
+#define DISK_BLKS 2048
+#define QD       8
+
+/* Create a new file ready to be used as an image. Every byte of the file will be zero. */
+struct blkdev *create_new_image(char * path, int blocks){
+    if (blocks < 1){
+        printf("create_new_image: error - blocks must be at least 1: %d\n", blocks);
+        return NULL;
+    }
+    FILE * image = fopen(path, "w");
+    fseek(image, blocks * BLOCK_SIZE - 1, SEEK_SET);
+    char c = 0;
+    fwrite(&c, 1, 1, image);
+    fclose(image);
+
+    return image_create(path);
+}
+
+struct client {
+    struct blk_mq *mq;
+    int ctx, nthreads, num_blocks, nops, do_write;
+    unsigned seed;
+    double seconds;
+};
+
+/* pick one of this client's blocks and submit a request for it.
+ * Writers tag every block with its number so readers can check it.
+ */
+void issue(struct client *c, struct blk_mq_req *rq){
+    int blk = rand_r(&c->seed) % c->num_blocks;
+    blk = blk - blk % c->nthreads + c->ctx;
+    if (blk >= c->num_blocks)
+        blk = c->ctx;
+    rq->op = c->do_write ? BLK_MQ_WRITE : BLK_MQ_READ;
+    rq->first_blk = blk;
+    rq->num_blks = 1;
+    rq->end_io = NULL;
+    memset(rq->buf, 0, BLOCK_SIZE);
+    *(int *)rq->buf = blk;
+    assert(blk_mq_submit(c->mq, c->ctx, rq) == SUCCESS);
+}
+
+/* each client keeps QD requests in flight on its own software context */
+void *client(void *arg){
+    struct client *c = arg;
+    struct blk_mq_req rqs[QD], *done[QD];
+    char *bufs = malloc(QD * BLOCK_SIZE);
+    int submitted = 0, completed = 0;
+    struct timespec t0, t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (; submitted < QD && submitted < c->nops; submitted++) {
+        rqs[submitted].buf = bufs + submitted * BLOCK_SIZE;
+        issue(c, &rqs[submitted]);
+    }
+    while (completed < c->nops) {
+        int n = blk_mq_reap(c->mq, c->ctx, done, 1, QD);
+        for (int k = 0; k < n; k++) {
+            assert(done[k]->result == SUCCESS);
+            if (done[k]->op == BLK_MQ_READ)
+                assert(*(int *)done[k]->buf == done[k]->first_blk);
+            completed++;
+            if (submitted < c->nops) {
+                submitted++;
+                issue(c, done[k]);
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    c->seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    free(bufs);
+    return NULL;
+}
+
+int main() {
+    char *img_names[NDISKS] = {"test1", "test2", "test3", "test4"};
+    struct blkdev *disks[NDISKS];
+    for (int k = 0; k < NDISKS; k++)
+        disks[k] = create_new_image(img_names[k], DISK_BLKS);
+    struct blkdev *raid0 = raid0_create(NDISKS, disks, UNIT);
+    assert(raid0 != NULL);
+    int num_blocks = blkdev_num_blocks(raid0);
+
+    // tag every block, one software context per thread
+    int nthreads = 8;
+    struct blk_mq *mq = blk_mq_create(raid0, nthreads, NDISKS, UNIT);
+    assert(mq != NULL);
+    char buf[BLOCK_SIZE];
+    for (int blk = 0; blk < num_blocks; blk++) {
+        struct blk_mq_req rq, *done;
+        memset(buf, 0, BLOCK_SIZE);
+        *(int *)buf = blk;
+        rq = (struct blk_mq_req){.op = BLK_MQ_WRITE, .first_blk = blk, .num_blks = 1, .buf = buf};
+        int ctx = blk_mq_ctx_id(mq);
+        assert(blk_mq_submit(mq, ctx, &rq) == SUCCESS);
+        assert(blk_mq_reap(mq, ctx, &done, 1, 1) == 1 && done == &rq);
+        assert(rq.result == SUCCESS);
+    }
+    for (int blk = 0; blk < num_blocks; blk++) {
+        assert(blkdev_read(raid0, blk, 1, buf) == SUCCESS);
+        assert(*(int *)buf == blk);
+    }
+    blk_mq_destroy(mq);
+
+    // random reads and writes at QD per thread, scaling the thread count
+    for (int do_write = 0; do_write < 2; do_write++) {
+        for (nthreads = 1; nthreads <= 8; nthreads *= 2) {
+            pthread_t threads[8];
+            struct client clients[8];
+            int nops = 20000;
+            mq = blk_mq_create(raid0, nthreads, NDISKS, UNIT);
+            for (int t = 0; t < nthreads; t++) {
+                clients[t] = (struct client){mq, t, nthreads, num_blocks, nops, do_write, t + 1, 0};
+                pthread_create(&threads[t], NULL, client, &clients[t]);
+            }
+            double longest = 0;
+            for (int t = 0; t < nthreads; t++) {
+                pthread_join(threads[t], NULL);
+                if (clients[t].seconds > longest)
+                    longest = clients[t].seconds;
+            }
+            blk_mq_destroy(mq);
+            printf("mq %s: %d threads, QD %d: %.0f IOPS\n", do_write ? "randwrite" : "randread",
+                   nthreads, QD, nthreads * nops / longest);
+        }
+    }
+
+    blkdev_close(raid0);
+    printf("mq test passed\n");
+}
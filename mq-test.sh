@@ -0,0 +1,2 @@
+gcc -g -w -pthread -o mq-test mq-test.c image.c raid.c integrity.c mq.c && ./mq-test &&
+rm test[0-9]*
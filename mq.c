@@ -0,0 +1,300 @@
+/*
+ * file:        mq.c
+ * description: multi-queue (blk-mq style) submission path into a blkdev
+ *
+ * Each submitting thread (or core) owns a software context. Requests are
+ * placed on that context's queue for the hardware context that will
+ * serve them; hardware contexts are chosen by address, so with
+ * map_unit set to a raid0/raid4 stripe unit and nr_hw equal to the data
+ * disk count, each hardware context drives one member image. Hardware
+ * context threads drain their queue from every software context and
+ * issue the I/O, then hand the request back to the software context it
+ * came from, so completions are reaped by the submitter.
+ *
+ * The blkdev must be safe for concurrent callers.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "blkdev.h"
+
+struct mq_list {
+    struct blk_mq_req *head, *tail;
+};
+
+struct mq_ctx {
+    pthread_mutex_t lock;
+    struct mq_list *submit;     /* one list per hardware context */
+    pthread_mutex_t done_lock;
+    pthread_cond_t done_cond;
+    struct mq_list done;
+    int ndone;
+};
+
+struct mq_hw {
+    struct blk_mq *mq;
+    int index;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int sleeping;
+};
+
+struct blk_mq {
+    struct blkdev *dev;
+    int nr_ctx;
+    int nr_hw;
+    lba_t map_unit;
+    int stop;
+    struct mq_ctx *ctx;
+    struct mq_hw *hw;
+};
+
+static void mq_list_add(struct mq_list *l, struct blk_mq_req *rq)
+{
+    rq->next = NULL;
+    if (l->tail)
+        l->tail->next = rq;
+    else
+        l->head = rq;
+    l->tail = rq;
+}
+
+/* take every request this hardware context has queued on any software
+ * context. Caller holds the hardware context's lock.
+ */
+static struct blk_mq_req *mq_hw_collect(struct mq_hw *hw)
+{
+    struct blk_mq *mq = hw->mq;
+    struct mq_list all = {NULL, NULL};
+    int i;
+
+    for (i = 0; i < mq->nr_ctx; i++) {
+        struct mq_ctx *ctx = &mq->ctx[i];
+        struct mq_list *l = &ctx->submit[hw->index];
+        if (__atomic_load_n(&l->head, __ATOMIC_RELAXED) == NULL)
+            continue;
+        pthread_mutex_lock(&ctx->lock);
+        if (l->head != NULL) {
+            if (all.tail)
+                all.tail->next = l->head;
+            else
+                all.head = l->head;
+            all.tail = l->tail;
+            l->head = l->tail = NULL;
+        }
+        pthread_mutex_unlock(&ctx->lock);
+    }
+    return all.head;
+}
+
+static void mq_complete(struct blk_mq *mq, struct blk_mq_req *rq)
+{
+    struct mq_ctx *ctx = &mq->ctx[rq->ctx];
+
+    if (rq->end_io != NULL) {
+        rq->end_io(rq);
+        return;
+    }
+    pthread_mutex_lock(&ctx->done_lock);
+    mq_list_add(&ctx->done, rq);
+    ctx->ndone++;
+    pthread_cond_broadcast(&ctx->done_cond);
+    pthread_mutex_unlock(&ctx->done_lock);
+}
+
+static void *mq_hw_thread(void *arg)
+{
+    struct mq_hw *hw = arg;
+    struct blk_mq *mq = hw->mq;
+    struct blkdev *dev = mq->dev;
+    struct blk_mq_req *rq, *next;
+
+    for (;;) {
+        pthread_mutex_lock(&hw->lock);
+        hw->sleeping = 1;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        while ((rq = mq_hw_collect(hw)) == NULL) {
+            if (__atomic_load_n(&mq->stop, __ATOMIC_ACQUIRE))
+                break;
+            pthread_cond_wait(&hw->cond, &hw->lock);
+        }
+        hw->sleeping = 0;
+        pthread_mutex_unlock(&hw->lock);
+        if (rq == NULL)
+            return NULL;
+
+        for (; rq != NULL; rq = next) {
+            next = rq->next;
+            if (rq->op == BLK_MQ_READ)
+                rq->result = dev->ops->read(dev, rq->first_blk, rq->num_blks, rq->buf);
+            else if (rq->op == BLK_MQ_WRITE)
+                rq->result = dev->ops->write(dev, rq->first_blk, rq->num_blks, rq->buf);
+            else if (rq->op == BLK_MQ_WRITE_FUA)
+                rq->result = blkdev_write_flags(dev, rq->first_blk, rq->num_blks, rq->buf,
+                                                BLKDEV_FUA);
+            else if (rq->op == BLK_MQ_FLUSH)
+                rq->result = blkdev_flush(dev);
+            else if (rq->op == BLK_MQ_DISCARD)
+                rq->result = blkdev_discard(dev, rq->first_blk, rq->num_blks);
+            else
+                rq->result = blkdev_write_zeroes(dev, rq->first_blk, rq->num_blks);
+            mq_complete(mq, rq);
+        }
+    }
+}
+
+/* the software context for the calling thread - the core it runs on */
+int blk_mq_ctx_id(struct blk_mq *mq)
+{
+    int cpu = sched_getcpu();
+    return cpu < 0 ? 0 : cpu % mq->nr_ctx;
+}
+
+/* queue a request on software context 'ctx'. If rq->end_io is set it is
+ * called from the hardware context when the request finishes; otherwise
+ * the request is returned by blk_mq_reap() on 'ctx'.
+ */
+int blk_mq_submit(struct blk_mq *mq, int ctx_id, struct blk_mq_req *rq)
+{
+    struct mq_ctx *ctx;
+    struct mq_hw *hw;
+
+    if (ctx_id < 0 || ctx_id >= mq->nr_ctx || rq->first_blk < 0 || rq->num_blks < 0)
+        return E_BADADDR;
+
+    ctx = &mq->ctx[ctx_id];
+    hw = &mq->hw[(uint64_t)(rq->first_blk / mq->map_unit) % mq->nr_hw];
+    rq->ctx = ctx_id;
+
+    pthread_mutex_lock(&ctx->lock);
+    mq_list_add(&ctx->submit[hw->index], rq);
+    pthread_mutex_unlock(&ctx->lock);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&hw->sleeping, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&hw->lock);
+        pthread_cond_signal(&hw->cond);
+        pthread_mutex_unlock(&hw->lock);
+    }
+    return SUCCESS;
+}
+
+/* collect between 'min' and 'max' completed requests of software
+ * context 'ctx' into 'done', waiting until at least 'min' are available.
+ * Returns the number collected.
+ */
+int blk_mq_reap(struct blk_mq *mq, int ctx_id, struct blk_mq_req **done, int min, int max)
+{
+    struct mq_ctx *ctx = &mq->ctx[ctx_id];
+    int n = 0;
+
+    pthread_mutex_lock(&ctx->done_lock);
+    while (ctx->ndone < min)
+        pthread_cond_wait(&ctx->done_cond, &ctx->done_lock);
+    while (n < max && ctx->done.head != NULL) {
+        done[n++] = ctx->done.head;
+        ctx->done.head = ctx->done.head->next;
+        ctx->ndone--;
+    }
+    if (ctx->done.head == NULL)
+        ctx->done.tail = NULL;
+    pthread_mutex_unlock(&ctx->done_lock);
+    return n;
+}
+
+/* create a multi-queue submission path into 'dev' with 'nr_ctx' software
+ * contexts and 'nr_hw' hardware contexts. Requests go to hardware context
+ * (first_blk / map_unit) % nr_hw.
+ */
+struct blk_mq *blk_mq_create(struct blkdev *dev, int nr_ctx, int nr_hw, lba_t map_unit)
+{
+    struct blk_mq *mq;
+    int i, ok = 1;
+
+    if (dev == NULL || nr_ctx < 1 || nr_hw < 1 || map_unit < 1)
+        return NULL;
+
+    mq = calloc(1, sizeof(*mq));
+    if (mq == NULL)
+        return NULL;
+    mq->dev = dev;
+    mq->nr_ctx = nr_ctx;
+    mq->map_unit = map_unit;
+    mq->ctx = calloc(nr_ctx, sizeof(*mq->ctx));
+    mq->hw = calloc(nr_hw, sizeof(*mq->hw));
+    if (mq->ctx == NULL || mq->hw == NULL) {
+        free(mq->ctx);
+        free(mq->hw);
+        free(mq);
+        return NULL;
+    }
+
+    for (i = 0; i < nr_ctx; i++) {
+        struct mq_ctx *ctx = &mq->ctx[i];
+        pthread_mutex_init(&ctx->lock, NULL);
+        pthread_mutex_init(&ctx->done_lock, NULL);
+        pthread_cond_init(&ctx->done_cond, NULL);
+        ctx->submit = calloc(nr_hw, sizeof(*ctx->submit));
+        ok = ok && ctx->submit != NULL;
+    }
+    /* blk_mq_destroy unwinds the hardware contexts started so far */
+    mq->nr_hw = 0;
+    for (i = 0; ok && i < nr_hw; i++) {
+        struct mq_hw *hw = &mq->hw[i];
+        hw->mq = mq;
+        hw->index = i;
+        pthread_mutex_init(&hw->lock, NULL);
+        pthread_cond_init(&hw->cond, NULL);
+        if (pthread_create(&hw->thread, NULL, mq_hw_thread, hw) != 0) {
+            fprintf(stderr, "blk_mq: can't start hardware context %d\n", i);
+            pthread_mutex_destroy(&hw->lock);
+            pthread_cond_destroy(&hw->cond);
+            ok = 0;
+            break;
+        }
+        mq->nr_hw = i + 1;
+    }
+    if (!ok) {
+        blk_mq_destroy(mq);
+        return NULL;
+    }
+    return mq;
+}
+
+/* stop the hardware contexts once everything queued has been issued,
+ * and free the queues. The blkdev is not closed; completed requests
+ * nobody reaped are simply dropped.
+ */
+void blk_mq_destroy(struct blk_mq *mq)
+{
+    int i;
+
+    __atomic_store_n(&mq->stop, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < mq->nr_hw; i++) {
+        pthread_mutex_lock(&mq->hw[i].lock);
+        pthread_cond_signal(&mq->hw[i].cond);
+        pthread_mutex_unlock(&mq->hw[i].lock);
+    }
+    for (i = 0; i < mq->nr_hw; i++) {
+        pthread_join(mq->hw[i].thread, NULL);
+        pthread_mutex_destroy(&mq->hw[i].lock);
+        pthread_cond_destroy(&mq->hw[i].cond);
+    }
+    for (i = 0; i < mq->nr_ctx; i++) {
+        struct mq_ctx *ctx = &mq->ctx[i];
+        free(ctx->submit);
+        pthread_mutex_destroy(&ctx->lock);
+        pthread_mutex_destroy(&ctx->done_lock);
+        pthread_cond_destroy(&ctx->done_cond);
+    }
+    free(mq->ctx);
+    free(mq->hw);
+    free(mq);
+}
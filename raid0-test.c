@@ -94,16 +94,83 @@ int main() {
             dump(copy, BLOCK_SIZE * num_blocks, "copy");
             dump(backup, BLOCK_SIZE * num_blocks, "backup");
             assert(memcmp(backup, copy, BLOCK_SIZE * num_blocks) == 0);
+
+            // sequential reads through readahead see the same data,
+            // including blocks rewritten while a window is buffered.
+            struct blkdev *ra = readahead_create(raid0, unit * ndisk, 4 * unit * ndisk);
+            assert(ra != NULL);
+            assert(blkdev_num_blocks(ra) == num_blocks);
+            for (int k = 0; k < num_blocks; k++) {
+                assert(blkdev_read(ra, k, 1, read_buf) == SUCCESS);
+                assert(memcmp(backup + k * BLOCK_SIZE, read_buf, BLOCK_SIZE) == 0);
+                if (k + unit < num_blocks && k % 3 == 0) {
+                    write_data(write_buf, BLOCK_SIZE);
+                    write_buf[0] = (char)k;
+                    assert(blkdev_write(ra, k + unit, 1, write_buf) == SUCCESS);
+                    memcpy(backup + (k + unit) * BLOCK_SIZE, write_buf, BLOCK_SIZE);
+                }
+            }
+            assert(blkdev_read(ra, 0, num_blocks, copy) == SUCCESS);
+            assert(memcmp(backup, copy, BLOCK_SIZE * num_blocks) == 0);
+
             // fail a disk and verify that the volume fails.
             image_fail(disks[0]);
             assert(blkdev_write(raid0, 0, 1, write_buf) != SUCCESS);
             assert(blkdev_read(raid0, 0, 1, read_buf) != SUCCESS);
 
-            // close
-            blkdev_close(raid0);
+            // close (the readahead layer closes raid0 underneath it)
+            blkdev_close(ra);
             printf("Raid0 test stripe size: %d, disk number: %d passed.\n", unit, ndisk);
         }
     }
 
+    // the same stripes over ramdisks, one of them on huge pages (which
+    // falls back to ordinary pages if there are none)
+    {
+        int ndisk = 4, unit = 8, nblks = 4096;
+        struct blkdev *disks[ndisk];
+        for (int k = 0; k < ndisk; k++)
+            disks[k] = ramdisk_create_bs(nblks, BLOCK_SIZE, k == 0 ? RAMDISK_HUGEPAGES : 0);
+        assert(ramdisk_create_bs(nblks, 1000, 0) == NULL);
+        raid0 = raid0_create(ndisk, disks, unit);
+        assert(raid0 != NULL);
+        int num_blocks = blkdev_num_blocks(raid0);
+        assert(num_blocks == nblks * ndisk);
+        char *backup = malloc((size_t)num_blocks * BLOCK_SIZE);
+        char *copy = malloc((size_t)num_blocks * BLOCK_SIZE);
+        assert(blkdev_read(raid0, 0, num_blocks, copy) == SUCCESS);
+        for (int k = 0; k < num_blocks * BLOCK_SIZE; k++)
+            assert(copy[k] == 0);
+        write_data(backup, num_blocks * BLOCK_SIZE);
+        for (int k = 0; k < num_blocks; k++)
+            backup[k * BLOCK_SIZE] = (char)(k + 1);
+        assert(blkdev_write(raid0, 0, num_blocks, backup) == SUCCESS);
+
+        // write_zeroes zeros, whole pages or not; discard may leave data
+        assert(blkdev_write_zeroes(raid0, 5, 301) == SUCCESS);
+        memset(backup + 5 * BLOCK_SIZE, 0, 301 * BLOCK_SIZE);
+        assert(blkdev_discard(raid0, 1000, 1000) == SUCCESS);
+        assert(blkdev_read(raid0, 0, 1000, copy) == SUCCESS);
+        assert(memcmp(backup, copy, 1000 * BLOCK_SIZE) == 0);
+        assert(blkdev_read(raid0, 2000, num_blocks - 2000, copy) == SUCCESS);
+        assert(memcmp(backup + 2000 * BLOCK_SIZE, copy, (size_t)(num_blocks - 2000) * BLOCK_SIZE) == 0);
+
+        // copying into a ramdisk reads the source straight into it
+        struct blkdev *rd = ramdisk_create(64);
+        assert(blkdev_copy_range(rd, 0, raid0, 2000, 64) == SUCCESS);
+        assert(blkdev_read(rd, 0, 64, copy) == SUCCESS);
+        assert(memcmp(backup + 2000 * BLOCK_SIZE, copy, 64 * BLOCK_SIZE) == 0);
+        assert(blkdev_read(rd, 60, 5, copy) == E_BADADDR);
+        blkdev_close(rd);
+
+        ramdisk_fail(disks[2]);
+        assert(blkdev_read(raid0, 2 * unit, 1, copy) == E_UNAVAIL);
+        assert(blkdev_read(raid0, 0, 1, copy) == SUCCESS);
+        blkdev_close(raid0);
+        free(backup);
+        free(copy);
+        printf("Raid0 ramdisk test passed.\n");
+    }
+
     printf("Raid0 test passed\n");
 }
@@ -1 +1 @@
-gcc -g -w -o raid0-test raid0-test.c image.c homework.c | ./raid0-test
+gcc -g -w -pthread -o raid0-test raid0-test.c image.c ramdisk.c raid.c integrity.c readahead.c && ./raid0-test
@@ -5,8 +5,36 @@
 #include <unistd.h>
 #include <assert.h>
 #include <time.h>
+#include <pthread.h>
 
 
+/* a read that waits on the second member of a raid4 with 4-block strips */
+void *slow_reader(void *raid4){
+    char buf[BLOCK_SIZE];
+    assert(blkdev_read(raid4, 4, 1, buf) == SUCCESS);
+    return NULL;
+}
+
+/* the last slow member event, and its member */
+int last_event = -1, last_member = -1;
+
+void slow_event(void *arg, struct blkdev *volume, int member, int event,
+                unsigned long member_ns, unsigned long peer_ns){
+    last_event = event;
+    last_member = member;
+}
+
+/* scrub callbacks: mismatched blocks reported, and the last checkpoint */
+long scrub_reported = 0, scrub_saved = -1;
+
+void scrub_mismatch(void *arg, lba_t first, lba_t n, int repaired){
+    scrub_reported += n;
+}
+
+void scrub_checkpoint(void *arg, lba_t next){
+    scrub_saved = next;
+}
+
 /* Write some data to an area of memory */
 void write_data(char* data, int length){
     for (int i = 0; i < length; i++){
@@ -14,8 +42,10 @@ void write_data(char* data, int length){
     }
 }
 
-/* Create a new file ready to be used as an image. Every byte of the file will be zero. */
-struct blkdev *create_new_image(char * path, int blocks){
+/* Create a new file ready to be used as an image with 'bs'-byte blocks. Every byte of the file
+ * will be zero.
+ */
+struct blkdev *create_new_image_bs(char * path, int blocks, int bs){
     if (blocks < 1){
         printf("create_new_image: error - blocks must be at least 1: %d\n", blocks);
         return NULL;
@@ -25,12 +55,16 @@ struct blkdev *create_new_image(char * path, int blocks){
      * directly to N-1 and then write 1 byte. The filesystem will fill in the rest of the bytes with
      * zero for us.
      */
-    fseek(image, blocks * BLOCK_SIZE - 1, SEEK_SET);
+    fseek(image, (long)blocks * bs - 1, SEEK_SET);
     char c = 0;
     fwrite(&c, 1, 1, image);
     fclose(image);
 
-    return image_create(path);
+    return image_create_bs(path, bs);
+}
+
+struct blkdev *create_new_image(char * path, int blocks){
+    return create_new_image_bs(path, blocks, BLOCK_SIZE);
 }
 
 /* Write a buffer to a file for debugging purposes */
@@ -40,6 +74,47 @@ void dump(char* buffer, int length, char* path){
     fclose(output);
 }
 
+/* Concurrent writers: thread 'id' owns every block b with b % nthreads == id,
+ * so threads share stripe rows (and parity blocks) but never data blocks.
+ */
+struct writer_arg {
+    struct blkdev *dev;
+    char *backup;
+    int num_blocks, id, nthreads;
+    unsigned seed;
+};
+
+void *writer(void *arg){
+    struct writer_arg *w = arg;
+    char buf[BLOCK_SIZE];
+    for (int i = 0; i < 4 * w->num_blocks; i++) {
+        int blk = rand_r(&w->seed) % w->num_blocks;
+        blk = blk - blk % w->nthreads + w->id;
+        if (blk >= w->num_blocks)
+            continue;
+        memset(buf, w->id * 31 + i, BLOCK_SIZE);
+        assert(blkdev_write(w->dev, blk, 1, buf) == SUCCESS);
+        memcpy(w->backup + blk * BLOCK_SIZE, buf, BLOCK_SIZE);
+    }
+    return NULL;
+}
+
+/* Check that the XOR of every member, parity included, is zero */
+void check_parity(struct blkdev **disks, int ndisk, int nblks_on_disk){
+    int bs = blkdev_block_size(disks[0]);
+    char buf[bs], sum[bs];
+    for (int b = 0; b < nblks_on_disk; b++) {
+        bzero(sum, bs);
+        for (int k = 0; k < ndisk; k++) {
+            assert(blkdev_read(disks[k], b, 1, buf) == SUCCESS);
+            for (int j = 0; j < bs; j++)
+                sum[j] ^= buf[j];
+        }
+        for (int j = 0; j < bs; j++)
+            assert(sum[j] == 0);
+    }
+}
+
 int main() {
     // Passes all other tests with different strip sizes (e.g. 2, 4, 7, and 32 sectors) 
     // and different numbers of disks.
@@ -80,9 +155,15 @@ int main() {
             bzero(copy, BLOCK_SIZE * num_blocks);
 
             write_data(write_buf, BLOCK_SIZE);
-            //overwrite raid0 with 0
-            assert(blkdev_write(raid4, 0, num_blocks, backup) == SUCCESS);
+            //overwrite raid4 with 0, without sending any data to the members
+            struct blkdev_stats before, after;
+            assert(blkdev_get_stats(disks[0], &before) == SUCCESS);
+            assert(blkdev_write_zeroes(raid4, 0, num_blocks) == SUCCESS);
+            assert(blkdev_get_stats(disks[0], &after) == SUCCESS);
+            assert(after.op[BLKDEV_OP_WRITE].ops == before.op[BLKDEV_OP_WRITE].ops);
+            assert(after.op[BLKDEV_OP_WRITE_ZEROES].ops > before.op[BLKDEV_OP_WRITE_ZEROES].ops);
             assert(blkdev_read(raid4, 0, num_blocks, copy) == SUCCESS);
+            assert(memcmp(backup, copy, BLOCK_SIZE * num_blocks) == 0);
             // reads data from the right disks and locations. 
             // overwrites the correct locations. 
             for(int i = 0; i < 7 * num_blocks; i++) {
@@ -97,12 +178,25 @@ int main() {
             assert(blkdev_read(raid4, 0, num_blocks, copy) == SUCCESS);
             assert(memcmp(backup, copy, BLOCK_SIZE * num_blocks) == 0);
 
+            // concurrent writers sharing stripe rows keep parity consistent
+            pthread_t threads[4];
+            struct writer_arg args[4];
+            for (int k = 0; k < 4; k++) {
+                args[k] = (struct writer_arg){raid4, backup, num_blocks, k, 4, rand()};
+                pthread_create(&threads[k], NULL, writer, &args[k]);
+            }
+            for (int k = 0; k < 4; k++)
+                pthread_join(threads[k], NULL);
+            assert(blkdev_read(raid4, 0, num_blocks, copy) == SUCCESS);
+            assert(memcmp(backup, copy, BLOCK_SIZE * num_blocks) == 0);
+            check_parity(disks, ndisk, num_blocks / (ndisk - 1));
+
             // fail a disk and verify that the volume doesn't fail.
             image_fail(disks[0]);
 
             bzero(backup, BLOCK_SIZE * num_blocks);
             bzero(copy, BLOCK_SIZE * num_blocks);
-            assert(blkdev_write(raid4, 0, num_blocks, backup) == SUCCESS);
+            assert(blkdev_write_zeroes(raid4, 0, num_blocks) == SUCCESS);
             for(int i = 0; i < num_blocks; i++) {
                 int start = rand() % num_blocks;
                 assert(blkdev_write(raid4, start, 1, write_buf) == SUCCESS);
@@ -118,6 +212,16 @@ int main() {
             assert(blkdev_read(raid4, 0, num_blocks, copy) == SUCCESS);
             assert(memcmp(backup, copy, BLOCK_SIZE * num_blocks) == 0);
 
+            // per-layer statistics see the degraded reads and RMW writes
+            struct blkdev_stats st;
+            assert(blkdev_get_stats(raid4, &st) == SUCCESS);
+            assert(st.op[BLKDEV_OP_READ].ops > 0 && st.op[BLKDEV_OP_WRITE].ops > 0);
+            assert(st.degraded_reads > 0 && st.rmw_writes > 0);
+            assert(blkdev_get_stats(disks[ndisk - 1], &st) == SUCCESS);
+            assert(st.op[BLKDEV_OP_WRITE].blocks >= (unsigned long)num_blocks);
+            if (unit == 32 && ndisk == 11)
+                blkdev_dump_stats(raid4, stdout);
+
             assert(blkdev_write(raid4, 0, 2, write_buf) == SUCCESS);
             assert(blkdev_read(raid4, 0, 2, read_buf) == SUCCESS);
             dump(read_buf, BLOCK_SIZE, "read-buf");
@@ -130,7 +234,7 @@ int main() {
             assert(raid4_replace(raid4, 0, newdisk) == SUCCESS);
             bzero(backup, BLOCK_SIZE * num_blocks);
             bzero(copy, BLOCK_SIZE * num_blocks);
-            assert(blkdev_write(raid4, 0, num_blocks, backup) == SUCCESS);
+            assert(blkdev_write_zeroes(raid4, 0, num_blocks) == SUCCESS);
             for(int i = 0; i < num_blocks; i++) {
                 int start = rand() % num_blocks;
                 assert(blkdev_write(raid4, start, 1, write_buf) == SUCCESS);
@@ -143,8 +247,13 @@ int main() {
             assert(blkdev_read(raid4, 0, num_blocks, copy) == SUCCESS);            
             assert(memcmp(backup, copy, BLOCK_SIZE * num_blocks) == 0);
 
-            // fail another disk
+            // the replacement took the array out of degraded state, so
+            // one more failure is survived, and a second one is not
             image_fail(disks[1]);
+            assert(blkdev_write(raid4, unit - 1, 2, write_buf) == SUCCESS);
+            assert(blkdev_read(raid4, unit - 1, 2, read_buf) == SUCCESS);
+            assert(memcmp(write_buf, read_buf, 2 * BLOCK_SIZE) == 0);
+            image_fail(disks[2]);
             assert(blkdev_write(raid4, unit - 1, 2, write_buf) != SUCCESS);
             assert(blkdev_read(raid4, unit - 1, 2, read_buf) != SUCCESS);
 
@@ -154,5 +263,375 @@ int main() {
         }
     }
 
+    // 4 KiB native members: the array advertises their block size and
+    // addresses, sizes and buffers are all in 4 KiB units.
+    {
+        int bs = 4096;
+        ndisk = 5;
+        unit = 4;
+        struct blkdev *disks[ndisk];
+        for (int k = 0; k < ndisk; k++)
+            disks[k] = create_new_image_bs(img_names[k], 32, bs);
+        assert(blkdev_block_size(disks[0]) == bs);
+
+        // members must agree on block size
+        struct blkdev *small = create_new_image("new disk", 32);
+        struct blkdev *mixed[2] = {disks[0], small};
+        assert(raid4_create(2, mixed, unit) == NULL);
+
+        raid4 = raid4_create(ndisk, disks, unit);
+        assert(raid4 != NULL);
+        assert(blkdev_block_size(raid4) == bs);
+        num_blocks = blkdev_num_blocks(raid4);
+        assert(num_blocks == 32 / unit * unit * (ndisk - 1));
+
+        char *backup = calloc(num_blocks, bs), *copy = calloc(num_blocks, bs);
+        char *write_buf = malloc(3 * bs);
+        assert(blkdev_write_zeroes(raid4, 0, num_blocks) == SUCCESS);
+        for (int i = 0; i < 4 * num_blocks; i++) {
+            int start = rand() % (num_blocks - 2);
+            int n = 1 + rand() % 3;
+            memset(write_buf, i, 3 * bs);
+            write_buf[bs - 1] = (char)start;
+            assert(blkdev_write(raid4, start, n, write_buf) == SUCCESS);
+            memcpy(backup + (size_t)start * bs, write_buf, (size_t)n * bs);
+        }
+        assert(blkdev_read(raid4, 0, num_blocks, copy) == SUCCESS);
+        assert(memcmp(backup, copy, (size_t)num_blocks * bs) == 0);
+        check_parity(disks, ndisk, num_blocks / (ndisk - 1));
+
+        // discard rows 1-3 (plus parts of rows 0 and 4, which stay as they
+        // were), then write into row 2: the rest of that row reads as zeros
+        // and parity still holds
+        int row_blks = unit * (ndisk - 1);
+        assert(blkdev_discard(raid4, row_blks - 1, 3 * row_blks + 2) == SUCCESS);
+        memset(backup + (size_t)row_blks * bs, 0, (size_t)3 * row_blks * bs);
+        memset(write_buf, 0x5a, bs);
+        assert(blkdev_write(raid4, 2 * row_blks + 5, 1, write_buf) == SUCCESS);
+        memcpy(backup + (size_t)(2 * row_blks + 5) * bs, write_buf, bs);
+        assert(blkdev_read(raid4, 2 * row_blks, row_blks, copy) == SUCCESS);
+        assert(memcmp(backup + (size_t)2 * row_blks * bs, copy, (size_t)row_blks * bs) == 0);
+        check_parity(disks, ndisk, num_blocks / (ndisk - 1));
+
+        // zeroing part of a row keeps parity right; so does zeroing the
+        // rest of a discarded row
+        assert(blkdev_write_zeroes(raid4, 3, row_blks + 6) == SUCCESS);
+        memset(backup + (size_t)3 * bs, 0, (size_t)(row_blks + 6) * bs);
+        assert(blkdev_write_zeroes(raid4, 3 * row_blks + 1, 2) == SUCCESS);
+        assert(blkdev_read(raid4, 0, num_blocks, copy) == SUCCESS);
+        assert(memcmp(backup, copy, (size_t)num_blocks * bs) == 0);
+        check_parity(disks, ndisk, num_blocks / (ndisk - 1));
+
+        // a replacement with a different block size is refused
+        image_fail(disks[2]);
+        assert(raid4_replace(raid4, 2, small) == E_SIZE);
+        blkdev_close(small);
+        struct blkdev *newdisk = create_new_image_bs("new disk", 32, bs);
+        assert(raid4_replace(raid4, 2, newdisk) == SUCCESS);
+        struct blkdev_stats st;
+        assert(blkdev_get_stats(raid4, &st) == SUCCESS);
+        assert(st.rebuild_skipped == 2 * (unsigned long)unit);
+        assert(blkdev_read(raid4, 0, num_blocks, copy) == SUCCESS);
+        assert(memcmp(backup, copy, (size_t)num_blocks * bs) == 0);
+
+        // and a readahead layer on top inherits it
+        struct blkdev *ra = readahead_create(raid4, unit * (ndisk - 1), 4 * unit * (ndisk - 1));
+        assert(blkdev_block_size(ra) == bs);
+        for (int k = 0; k < num_blocks; k++) {
+            assert(blkdev_read(ra, k, 1, copy) == SUCCESS);
+            assert(memcmp(backup + (size_t)k * bs, copy, bs) == 0);
+        }
+        blkdev_close(ra);
+        free(backup);
+        free(copy);
+        free(write_buf);
+        printf("Raid4 test block size: %d passed.\n", bs);
+    }
+
+    // a fresh array rebuilds only the rows that hold data: row 0, which
+    // we write, and the last row, where create_new_image put a byte
+    {
+        int bs = 4096;
+        ndisk = 5;
+        unit = 4;
+        struct blkdev *disks[ndisk];
+        for (int k = 0; k < ndisk; k++)
+            disks[k] = create_new_image_bs(img_names[k], 32, bs);
+        raid4 = raid4_create(ndisk, disks, unit);
+        num_blocks = blkdev_num_blocks(raid4);
+        int row_blks = unit * (ndisk - 1);
+        char *backup = malloc((size_t)num_blocks * bs), *copy = malloc((size_t)num_blocks * bs);
+        assert(blkdev_read(raid4, 0, num_blocks, backup) == SUCCESS);
+        memset(backup, 0x77, (size_t)row_blks * bs);
+        assert(blkdev_write(raid4, 0, row_blks, backup) == SUCCESS);
+        image_fail(disks[1]);
+        struct blkdev *newdisk = create_new_image_bs("new disk", 32, bs);
+        assert(raid4_replace(raid4, 1, newdisk) == SUCCESS);
+        struct blkdev_stats st;
+        assert(blkdev_get_stats(raid4, &st) == SUCCESS);
+        assert(st.rebuilt == 2 * (unsigned long)unit && st.rebuild_skipped == 6 * (unsigned long)unit);
+        assert(blkdev_read(raid4, 0, num_blocks, copy) == SUCCESS);
+        assert(memcmp(backup, copy, (size_t)num_blocks * bs) == 0);
+        disks[1] = newdisk;
+        check_parity(disks, ndisk, num_blocks / (ndisk - 1));
+        blkdev_close(raid4);
+        free(backup);
+        free(copy);
+        printf("Raid4 sparse rebuild test passed.\n");
+    }
+
+    // a slow member is read around from the others plus parity, once
+    // past the deadline, or straight away when its queue is full
+    {
+        ndisk = 4;
+        unit = 4;
+        struct sim_params sp;
+        struct blkdev *disks[ndisk], *slow;
+        memset(&sp, 0, sizeof(sp));
+        for (int k = 0; k < ndisk; k++)
+            disks[k] = ramdisk_create(64);
+        slow = disks[1] = sim_create(disks[1], &sp);
+        raid4 = raid4_create(ndisk, disks, unit);
+        num_blocks = blkdev_num_blocks(raid4);
+        char *data = malloc(num_blocks * BLOCK_SIZE), *copy = malloc(num_blocks * BLOCK_SIZE);
+        write_data(data, num_blocks * BLOCK_SIZE);
+        assert(blkdev_write(raid4, 0, num_blocks, data) == SUCCESS);
+        sp.lat_ns = 50000000;
+        sim_configure(slow, &sp);
+        raid4_set_slow_member(raid4, 2000000, 0);
+        unsigned long t0 = blkdev_stats_start();
+        assert(blkdev_read(raid4, unit, unit, copy) == SUCCESS);
+        assert(blkdev_stats_start() - t0 < 40000000);
+        assert(memcmp(copy, data + unit * BLOCK_SIZE, unit * BLOCK_SIZE) == 0);
+        struct blkdev_stats st;
+        assert(blkdev_get_stats(raid4, &st) == SUCCESS);
+        assert(st.hedged_reads == 1 && st.hedge_wins == 1 && st.degraded_reads == 0);
+
+        // reads of the other members don't wait on it at all
+        t0 = blkdev_stats_start();
+        assert(blkdev_read(raid4, 2 * unit, unit, copy) == SUCCESS);
+        assert(blkdev_stats_start() - t0 < 40000000);
+
+        // with a queue limit of 1, one read waiting on the member is
+        // enough for the rest to go around it
+        pthread_t t;
+        raid4_set_slow_member(raid4, 0, 0);
+        assert(pthread_create(&t, NULL, slow_reader, raid4) == 0);
+        usleep(10000);
+        raid4_set_slow_member(raid4, 0, 1);
+        t0 = blkdev_stats_start();
+        assert(blkdev_read(raid4, 0, num_blocks, copy) == SUCCESS);
+        assert(memcmp(copy, data, num_blocks * BLOCK_SIZE) == 0);
+        assert(blkdev_get_stats(raid4, &st) == SUCCESS);
+        assert(st.hedged_reads > 1 && st.degraded_reads == 0);
+        assert(blkdev_stats_start() - t0 < 100000000);
+        pthread_join(t, NULL);
+
+        // without either, the read waits for the member
+        raid4_set_slow_member(raid4, 0, 0);
+        t0 = blkdev_stats_start();
+        assert(blkdev_read(raid4, unit, 1, copy) == SUCCESS);
+        assert(blkdev_stats_start() - t0 >= 50000000);
+        blkdev_close(raid4);
+        free(data);
+        free(copy);
+        printf("Raid4 slow member test passed.\n");
+    }
+
+    // a member the slow member policy avoids is read around from parity,
+    // bar the odd probe, until it speeds up again
+    {
+        ndisk = 4;
+        unit = 4;
+        struct sim_params sp;
+        struct blkdev *disks[ndisk], *slow;
+        memset(&sp, 0, sizeof(sp));
+        for (int k = 0; k < ndisk; k++)
+            disks[k] = ramdisk_create(64);
+        slow = disks[2] = sim_create(disks[2], &sp);
+        raid4 = raid4_create(ndisk, disks, unit);
+        num_blocks = blkdev_num_blocks(raid4);
+        char *data = malloc(num_blocks * BLOCK_SIZE), *copy = malloc(BLOCK_SIZE);
+        write_data(data, num_blocks * BLOCK_SIZE);
+        assert(blkdev_write(raid4, 0, num_blocks, data) == SUCCESS);
+        // min_ns keeps the sim layer's own overhead from counting as slow
+        struct raid_slow_policy policy = {.action = RAID_SLOW_AVOID, .strikes = 2,
+                                          .min_ns = 100000, .event = slow_event};
+        assert(raid_set_slow_policy(raid4, &policy) == SUCCESS);
+        sp.lat_ns = 500000;
+        sim_configure(slow, &sp);
+        for (int i = 0; i < 1000 && last_event < 0; i++)
+            assert(blkdev_read(raid4, i % num_blocks, 1, copy) == SUCCESS);
+        assert(last_event == RAID_EVENT_SLOW && last_member == 2);
+
+        // 'slow' holds blocks 8-11 of each stripe row
+        unsigned long t0 = blkdev_stats_start();
+        for (int i = 0; i < 32; i++) {
+            assert(blkdev_read(raid4, 8 + i % 4, 1, copy) == SUCCESS);
+            assert(memcmp(copy, data + (8 + i % 4) * BLOCK_SIZE, BLOCK_SIZE) == 0);
+        }
+        assert(blkdev_stats_start() - t0 < 16 * 500000UL);
+        struct blkdev_stats st;
+        assert(blkdev_get_stats(raid4, &st) == SUCCESS);
+        assert(st.degraded_reads == 0);
+
+        sp.lat_ns = 0;
+        sim_configure(slow, &sp);
+        for (int i = 0; i < 20000 && last_event == RAID_EVENT_SLOW; i++)
+            assert(blkdev_read(raid4, 8 + i % 4, 1, copy) == SUCCESS);
+        assert(last_event == RAID_EVENT_RECOVERED && last_member == 2);
+        blkdev_close(raid4);
+        free(data);
+        free(copy);
+        printf("Raid4 slow member policy test passed.\n");
+    }
+
+    // scrub finds rows whose parity doesn't match, and repairs them
+    {
+        ndisk = 4;
+        unit = 4;
+        struct blkdev *disks[ndisk];
+        for (int k = 0; k < ndisk; k++)
+            disks[k] = ramdisk_create(64);
+        raid4 = raid4_create(ndisk, disks, unit);
+        num_blocks = blkdev_num_blocks(raid4);
+        char *data = malloc(num_blocks * BLOCK_SIZE), junk[BLOCK_SIZE];
+        write_data(data, num_blocks * BLOCK_SIZE);
+        assert(blkdev_write(raid4, 0, num_blocks, data) == SUCCESS);
+        memset(junk, 0x5a, BLOCK_SIZE);
+        assert(blkdev_write(disks[3], 5, 1, junk) == SUCCESS);  // parity, row 1
+        assert(blkdev_write(disks[0], 41, 1, junk) == SUCCESS); // data, row 10
+
+        // checking, in two goes: up to row 8, then resumed from there
+        struct raid_scrub scrub = {.end = 32, .mismatch = scrub_mismatch,
+                                   .checkpoint = scrub_checkpoint};
+        assert(raid_scrub(raid4, &scrub) == SUCCESS);
+        assert(scrub.next == 32 && scrub_saved == 32);
+        assert(scrub.mismatched == unit && scrub.repaired == 0);
+        scrub.end = 0;
+        assert(raid_scrub(raid4, &scrub) == SUCCESS);
+        assert(scrub.next == 64 && scrub_saved == 64 && scrub.checked == 64);
+        assert(scrub.mismatched == 2 * unit && scrub_reported == 2 * unit);
+
+        // repairing
+        memset(&scrub, 0, sizeof(scrub));
+        scrub.flags = RAID_SCRUB_REPAIR;
+        assert(raid_scrub(raid4, &scrub) == SUCCESS);
+        assert(scrub.mismatched == 2 * unit && scrub.repaired == 2 * unit);
+        check_parity(disks, ndisk, 64);
+        memset(&scrub, 0, sizeof(scrub));
+        assert(raid_scrub(raid4, &scrub) == SUCCESS);
+        assert(scrub.checked == 64 && scrub.mismatched == 0);
+        struct blkdev_stats st;
+        assert(blkdev_get_stats(raid4, &st) == SUCCESS);
+        assert(st.scrubbed == 3 * 64 && st.scrub_mismatches == 4 * unit);
+
+        // a repairing scrub rewrites a member it can't read, and fails
+        // it when that doesn't work either; then the array is degraded,
+        // with nothing to check against
+        ramdisk_fail(disks[1]);
+        memset(&scrub, 0, sizeof(scrub));
+        scrub.flags = RAID_SCRUB_REPAIR;
+        assert(raid_scrub(raid4, &scrub) == E_UNAVAIL);
+        memset(&scrub, 0, sizeof(scrub));
+        assert(raid_scrub(raid4, &scrub) == E_UNAVAIL);
+        blkdev_close(raid4);
+        free(data);
+        printf("Raid4 scrub test passed.\n");
+    }
+
+    // a hot spare rebuilds a failed member in the background, at the
+    // rebuild class's bandwidth: 2 KiB rows at 4 MB/s take 7.5ms for
+    // the first 15. After that the array can lose a member again.
+    {
+        ndisk = 4;
+        unit = 4;
+        struct blkdev *disks[ndisk];
+        for (int k = 0; k < ndisk; k++)
+            disks[k] = ramdisk_create(64);
+        raid4 = raid4_create(ndisk, disks, unit);
+        num_blocks = blkdev_num_blocks(raid4);
+        char *data = malloc(num_blocks * BLOCK_SIZE), *copy = malloc(num_blocks * BLOCK_SIZE);
+        write_data(data, num_blocks * BLOCK_SIZE);
+        assert(blkdev_write(raid4, 0, num_blocks, data) == SUCCESS);
+        struct raid_throttle throttle = {.max_bw = 4e6};
+        assert(raid_set_throttle(raid4, RAID_PRIO_REBUILD, &throttle) == SUCCESS);
+        struct blkdev *spare = ramdisk_create(64);
+        assert(raid_add_spare(raid4, spare) == SUCCESS);
+        assert(raid_wait_spares(raid4) == 1);
+
+        ramdisk_fail(disks[2]);
+        unsigned long t0 = blkdev_stats_start();
+        assert(blkdev_read(raid4, 0, num_blocks, copy) == SUCCESS);
+        assert(memcmp(data, copy, num_blocks * BLOCK_SIZE) == 0);
+        assert(raid_wait_spares(raid4) == 0);
+        assert(blkdev_stats_start() - t0 >= 7500000);
+        struct blkdev_stats st;
+        assert(blkdev_get_stats(raid4, &st) == SUCCESS);
+        assert(st.rebuilt == 64 && st.throttled_ns > 0);
+        unsigned long degraded = st.degraded_reads;
+        assert(blkdev_read(raid4, 0, num_blocks, copy) == SUCCESS);
+        assert(memcmp(data, copy, num_blocks * BLOCK_SIZE) == 0);
+        assert(blkdev_get_stats(raid4, &st) == SUCCESS && st.degraded_reads == degraded);
+        disks[2] = spare;
+        check_parity(disks, ndisk, 64);
+
+        ramdisk_fail(disks[0]);
+        assert(blkdev_read(raid4, 0, num_blocks, copy) == SUCCESS);
+        assert(memcmp(data, copy, num_blocks * BLOCK_SIZE) == 0);
+        blkdev_close(raid4);
+        free(data);
+        free(copy);
+        printf("Raid4 hot spare test passed.\n");
+    }
+
+    // a checkpointed rebuild stopped by close carries on from where it
+    // was saved once the new disk is handed back to the array,
+    // reassembled without it
+    {
+        ndisk = 4;
+        unit = 4;
+        struct blkdev *disks[ndisk];
+        for (int k = 0; k < ndisk; k++)
+            disks[k] = create_new_image(img_names[k], 64);
+        raid4 = raid4_create(ndisk, disks, unit);
+        num_blocks = blkdev_num_blocks(raid4);
+        char *data = malloc(num_blocks * BLOCK_SIZE), *copy = malloc(num_blocks * BLOCK_SIZE);
+        write_data(data, num_blocks * BLOCK_SIZE);
+        assert(blkdev_write(raid4, 0, num_blocks, data) == SUCCESS);
+        struct raid_throttle throttle = {.max_bw = 1e6};
+        assert(raid_set_throttle(raid4, RAID_PRIO_REBUILD, &throttle) == SUCCESS);
+        assert(raid_set_rebuild_checkpoint(raid4, 2 * unit) == SUCCESS);
+        assert(raid_add_spare(raid4, create_new_image(img_names[4], 64)) == SUCCESS);
+        image_fail(disks[1]);
+        assert(blkdev_read(raid4, 0, num_blocks, copy) == SUCCESS);
+        struct blkdev_stats st;
+        do {
+            usleep(1000);
+            assert(blkdev_get_stats(raid4, &st) == SUCCESS);
+        } while (st.rebuilt < 32);
+        blkdev_close(raid4);
+
+        for (int k = 0; k < ndisk; k++)
+            disks[k] = k == 1 ? NULL : image_create(img_names[k]);
+        raid4 = raid4_create(ndisk, disks, unit);
+        assert(blkdev_read(raid4, 0, num_blocks, copy) == SUCCESS);
+        assert(memcmp(data, copy, num_blocks * BLOCK_SIZE) == 0);
+        disks[1] = image_create(img_names[4]);
+        assert(raid_add_spare(raid4, disks[1]) == SUCCESS);
+        assert(raid_wait_spares(raid4) == 0);
+        assert(blkdev_get_stats(raid4, &st) == SUCCESS);
+        assert(st.rebuilt <= 32 && st.degraded_reads > 0);
+        unsigned long degraded = st.degraded_reads;
+        assert(blkdev_read(raid4, 0, num_blocks, copy) == SUCCESS);
+        assert(memcmp(data, copy, num_blocks * BLOCK_SIZE) == 0);
+        assert(blkdev_get_stats(raid4, &st) == SUCCESS && st.degraded_reads == degraded);
+        check_parity(disks, ndisk, 64);
+        blkdev_close(raid4);
+        free(data);
+        free(copy);
+        printf("Raid4 resumed rebuild test passed.\n");
+    }
+
     printf("raid4 test passed\n");
 }
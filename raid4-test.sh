@@ -1,2 +1,2 @@
-gcc -g -w -o raid4-test raid4-test.c image.c homework.c && ./raid4-test &&
+gcc -g -w -pthread -o raid4-test raid4-test.c image.c ramdisk.c sim.c raid.c integrity.c readahead.c -lm && ./raid4-test &&
 rm test[0-9]*
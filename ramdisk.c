@@ -0,0 +1,298 @@
+/*
+ * file:        ramdisk.c
+ * description: in-memory blkdev
+ *
+ * A ramdisk keeps its blocks in an anonymous mapping, so I/O is a
+ * memcpy: stacks built on ramdisks show the CPU cost of the layers above
+ * without any filesystem underneath, and make a fast tier where
+ * contents don't need to outlive the process. ramdisk_fail() injects
+ * failures the way image_fail() does.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "blkdev.h"
+
+#define RAMDISK_DEV_MAGIC 0x12340002
+#define HUGE_PAGE (2 << 20)
+
+struct ramdisk_dev {
+    int   magic;
+    char *mem;
+    size_t len;                 /* bytes mapped */
+    size_t page;                /* unit that discard can give back */
+    lba_t nblks;
+    int   bs;                   /* logical block size, bytes */
+    int   failed;               /* set by ramdisk_fail */
+    struct blkdev_stats stats;
+};
+
+static lba_t ramdisk_num_blocks(struct blkdev *dev)
+{
+    struct ramdisk_dev *rd = dev->private;
+    assert(rd != NULL && rd->magic == RAMDISK_DEV_MAGIC);
+    return rd->nblks;
+}
+
+static int ramdisk_block_size(struct blkdev *dev)
+{
+    struct ramdisk_dev *rd = dev->private;
+    return rd->bs;
+}
+
+/* every op starts with the same checks */
+static int ramdisk_check(struct ramdisk_dev *rd, lba_t offset, lba_t len)
+{
+    assert(rd->magic == RAMDISK_DEV_MAGIC);
+
+    if (__atomic_load_n(&rd->failed, __ATOMIC_ACQUIRE))
+        return E_UNAVAIL;
+    if (offset < 0 || len < 0 || offset > rd->nblks - len)
+        return E_BADADDR;
+    return SUCCESS;
+}
+
+static int ramdisk_read_blocks(struct blkdev *dev, lba_t offset, lba_t len, void *buf)
+{
+    struct ramdisk_dev *rd = dev->private;
+    int val = ramdisk_check(rd, offset, len);
+
+    if (val == SUCCESS)
+        memcpy(buf, rd->mem + (size_t)offset * rd->bs, (size_t)len * rd->bs);
+    return val;
+}
+
+static int ramdisk_write_blocks(struct blkdev *dev, lba_t offset, lba_t len, void *buf)
+{
+    struct ramdisk_dev *rd = dev->private;
+    int val = ramdisk_check(rd, offset, len);
+
+    if (val == SUCCESS)
+        memcpy(rd->mem + (size_t)offset * rd->bs, buf, (size_t)len * rd->bs);
+    return val;
+}
+
+/* give the whole pages in [start, end) back to the kernel; they read as
+ * zeros from then on. *head and *tail are set to the bytes at either end
+ * that were not released. Returns -1 if nothing was.
+ */
+static int ramdisk_release(struct ramdisk_dev *rd, size_t start, size_t end,
+                           size_t *head, size_t *tail)
+{
+    size_t first = (start + rd->page - 1) / rd->page * rd->page;
+    size_t last = end / rd->page * rd->page;
+
+    if (first >= last || madvise(rd->mem + first, last - first, MADV_DONTNEED) < 0) {
+        *head = end - start;
+        *tail = 0;
+        return -1;
+    }
+    *head = first - start;
+    *tail = end - last;
+    return 0;
+}
+
+/* discard frees whole pages and leaves partial ones as they are */
+static int ramdisk_discard_blocks(struct blkdev *dev, lba_t offset, lba_t len)
+{
+    struct ramdisk_dev *rd = dev->private;
+    size_t head, tail;
+    int val = ramdisk_check(rd, offset, len);
+
+    if (val == SUCCESS && len > 0)
+        ramdisk_release(rd, (size_t)offset * rd->bs, (size_t)(offset + len) * rd->bs,
+                        &head, &tail);
+    return val;
+}
+
+static int ramdisk_write_zeroes_blocks(struct blkdev *dev, lba_t offset, lba_t len)
+{
+    struct ramdisk_dev *rd = dev->private;
+    size_t start = (size_t)offset * rd->bs, end = (size_t)(offset + len) * rd->bs;
+    size_t head, tail;
+    int val = ramdisk_check(rd, offset, len);
+
+    if (val != SUCCESS || len == 0)
+        return val;
+    ramdisk_release(rd, start, end, &head, &tail);
+    memset(rd->mem + start, 0, head);
+    memset(rd->mem + end - tail, 0, tail);
+    return SUCCESS;
+}
+
+/* a copy into a ramdisk reads the source straight into our memory */
+static int ramdisk_copy_range_blocks(struct blkdev *dev, lba_t offset, struct blkdev *src,
+                                     lba_t src_offset, lba_t len)
+{
+    struct ramdisk_dev *rd = dev->private;
+    int val = ramdisk_check(rd, offset, len);
+
+    if (val != SUCCESS)
+        return val;
+    if (blkdev_block_size(src) != rd->bs)
+        return E_BADADDR;
+    return src->ops->read(src, src_offset, len, rd->mem + (size_t)offset * rd->bs);
+}
+
+static int ramdisk_read(struct blkdev *dev, lba_t offset, lba_t len, void *buf)
+{
+    struct ramdisk_dev *rd = dev->private;
+    unsigned long t0 = blkdev_stats_start();
+    int val = ramdisk_read_blocks(dev, offset, len, buf);
+    blkdev_stats_end(&rd->stats, BLKDEV_OP_READ, len, val, t0);
+    return val;
+}
+
+static int ramdisk_write(struct blkdev *dev, lba_t offset, lba_t len, void *buf)
+{
+    struct ramdisk_dev *rd = dev->private;
+    unsigned long t0 = blkdev_stats_start();
+    int val = ramdisk_write_blocks(dev, offset, len, buf);
+    blkdev_stats_end(&rd->stats, BLKDEV_OP_WRITE, len, val, t0);
+    return val;
+}
+
+static int ramdisk_discard(struct blkdev *dev, lba_t offset, lba_t len)
+{
+    struct ramdisk_dev *rd = dev->private;
+    unsigned long t0 = blkdev_stats_start();
+    int val = ramdisk_discard_blocks(dev, offset, len);
+    blkdev_stats_end(&rd->stats, BLKDEV_OP_DISCARD, len, val, t0);
+    return val;
+}
+
+static int ramdisk_write_zeroes(struct blkdev *dev, lba_t offset, lba_t len)
+{
+    struct ramdisk_dev *rd = dev->private;
+    unsigned long t0 = blkdev_stats_start();
+    int val = ramdisk_write_zeroes_blocks(dev, offset, len);
+    blkdev_stats_end(&rd->stats, BLKDEV_OP_WRITE_ZEROES, len, val, t0);
+    return val;
+}
+
+static int ramdisk_copy_range(struct blkdev *dev, lba_t offset, struct blkdev *src,
+                              lba_t src_offset, lba_t len)
+{
+    struct ramdisk_dev *rd = dev->private;
+    unsigned long t0 = blkdev_stats_start();
+    int val = ramdisk_copy_range_blocks(dev, offset, src, src_offset, len);
+    blkdev_stats_end(&rd->stats, BLKDEV_OP_WRITE, len, val, t0);
+    return val;
+}
+
+static struct blkdev_stats *ramdisk_stats(struct blkdev *dev)
+{
+    struct ramdisk_dev *rd = dev->private;
+    assert(rd->magic == RAMDISK_DEV_MAGIC);
+    return &rd->stats;
+}
+
+static void ramdisk_close(struct blkdev *dev)
+{
+    struct ramdisk_dev *rd = dev->private;
+    assert(rd->magic == RAMDISK_DEV_MAGIC);
+
+    munmap(rd->mem, rd->len);
+    free(rd);
+    dev->private = NULL;        /* crash any attempts to access */
+    free(dev);
+}
+
+/* no flush: there is nothing a ramdisk could make durable */
+struct blkdev_ops ramdisk_ops = {
+    .num_blocks = ramdisk_num_blocks,
+    .read = ramdisk_read,
+    .write = ramdisk_write,
+    .close = ramdisk_close,
+    .stats = ramdisk_stats,
+    .block_size = ramdisk_block_size,
+    .discard = ramdisk_discard,
+    .write_zeroes = ramdisk_write_zeroes,
+    .copy_range = ramdisk_copy_range,
+    .name = "ramdisk"
+};
+
+/* create a zero-filled ramdisk of 'nblocks' 'block_size'-byte blocks.
+ * With RAMDISK_HUGEPAGES it is backed by huge pages (MAP_HUGETLB) if
+ * enough are reserved - taken from the pool up front, so running short
+ * fails here rather than on some later write - or else asks for
+ * transparent huge pages. Ordinary pages are only committed as blocks
+ * are written.
+ */
+struct blkdev *ramdisk_create_bs(lba_t nblocks, int block_size, int flags)
+{
+    struct blkdev *dev;
+    struct ramdisk_dev *rd;
+    size_t len;
+
+    if (block_size < BLOCK_SIZE || block_size > BLOCK_SIZE_MAX ||
+        (block_size & (block_size - 1)) != 0 || nblocks < 1) {
+        fprintf(stderr, "ramdisk: bad size %lld x %d\n", (long long)nblocks, block_size);
+        return NULL;
+    }
+
+    dev = malloc(sizeof(*dev));
+    rd = calloc(1, sizeof(*rd));
+    if (dev == NULL || rd == NULL) {
+        free(dev);
+        free(rd);
+        return NULL;
+    }
+
+    len = (size_t)nblocks * block_size;
+    rd->mem = MAP_FAILED;
+    rd->page = sysconf(_SC_PAGESIZE);
+    if (flags & RAMDISK_HUGEPAGES) {
+        rd->len = (len + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+        rd->mem = mmap(NULL, rd->len, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (rd->mem != MAP_FAILED)
+            rd->page = HUGE_PAGE;
+    }
+    if (rd->mem == MAP_FAILED) {
+        rd->len = len;
+        rd->mem = mmap(NULL, rd->len, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (rd->mem != MAP_FAILED && (flags & RAMDISK_HUGEPAGES))
+            madvise(rd->mem, rd->len, MADV_HUGEPAGE);
+    }
+    if (rd->mem == MAP_FAILED) {
+        fprintf(stderr, "ramdisk: can't map %zu bytes: %s\n", len, strerror(errno));
+        free(dev);
+        free(rd);
+        return NULL;
+    }
+
+    rd->nblks = nblocks;
+    rd->bs = block_size;
+    rd->failed = 0;
+    rd->magic = RAMDISK_DEV_MAGIC;
+    dev->private = rd;
+    dev->ops = &ramdisk_ops;
+    return dev;
+}
+
+struct blkdev *ramdisk_create(lba_t nblocks)
+{
+    return ramdisk_create_bs(nblocks, BLOCK_SIZE, 0);
+}
+
+/* force a ramdisk into failure; any further access returns E_UNAVAIL.
+ * The memory stays mapped until close.
+ */
+void ramdisk_fail(struct blkdev *dev)
+{
+    struct ramdisk_dev *rd = dev->private;
+    assert(rd->magic == RAMDISK_DEV_MAGIC);
+
+    __atomic_store_n(&rd->failed, 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,534 @@
+/*
+ * file:        readahead.c
+ * description: sequential stream detection and adaptive readahead,
+ *              stackable on top of any blkdev (typically a raid0 volume)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "blkdev.h"
+
+#define RA_DEV_MAGIC 0x12340010
+
+#define RA_STREAMS   4          /* concurrent sequential streams tracked */
+#define RA_SEQ_HITS  2          /* contiguous reads before we start prefetching */
+#define RA_WORKERS   RA_STREAMS /* prefetch threads, one window each at a time */
+
+/* a window is a stripe-aligned range of blocks that is either being
+ * fetched by the worker or is ready to be copied out to readers.
+ */
+enum {RA_EMPTY, RA_QUEUED, RA_INFLIGHT, RA_READY};
+
+struct ra_window {
+    lba_t start;
+    lba_t len;
+    int   state;
+    int   stale;                /* written to while in flight - discard */
+    char *buf;
+};
+
+/* each stream double-buffers: one window is consumed by the reader
+ * while the other is being prefetched.
+ */
+struct ra_stream {
+    lba_t next;                 /* block after the last read, -1 if unused */
+    int hits;                   /* consecutive sequential reads */
+    lba_t size;                 /* current window size, grows to max_window */
+    unsigned long used;         /* for LRU replacement */
+    struct ra_window win[2];
+};
+
+struct ra_dev {
+    int magic;
+    struct blkdev *dev;
+    lba_t nblks;
+    int bs;                     /* block size of 'dev', bytes */
+    lba_t align;                /* window alignment, e.g. unit * ndisks */
+    lba_t max_window;
+    pthread_mutex_t lock;       /* protects streams and windows, never held
+                                 * across calls into 'dev' */
+    pthread_cond_t cond;        /* window state changed or work queued */
+    pthread_t workers[RA_WORKERS];
+    int nworkers;
+    int stop;
+    unsigned long tick;
+    struct ra_stream streams[RA_STREAMS];
+    struct blkdev_stats stats;
+};
+
+static lba_t ra_align_up(struct ra_dev *ra, lba_t blk)
+{
+    return (blk + ra->align - 1) / ra->align * ra->align;
+}
+
+static void ra_reset_stream(struct ra_stream *s)
+{
+    int i;
+    s->next = -1;
+    s->hits = 0;
+    s->size = 0;
+    for (i = 0; i < 2; i++) {
+        if (s->win[i].state == RA_INFLIGHT)
+            s->win[i].stale = 1;
+        else
+            s->win[i].state = RA_EMPTY;
+    }
+}
+
+/* find the stream a read belongs to: one that this read continues, or
+ * one whose windows already hold the first block. Otherwise recycle the
+ * least recently used stream.
+ */
+static struct ra_stream *ra_find_stream(struct ra_dev *ra, lba_t first_blk)
+{
+    struct ra_stream *s, *lru = &ra->streams[0];
+    int i, j;
+
+    for (i = 0; i < RA_STREAMS; i++)
+        if (ra->streams[i].next == first_blk)
+            return &ra->streams[i];
+
+    for (i = 0; i < RA_STREAMS; i++) {
+        s = &ra->streams[i];
+        for (j = 0; j < 2; j++)
+            if (s->win[j].state != RA_EMPTY && !s->win[j].stale &&
+                first_blk >= s->win[j].start &&
+                first_blk < s->win[j].start + s->win[j].len)
+                return s;
+        if (s->used < lru->used)
+            lru = s;
+    }
+    ra_reset_stream(lru);
+    return lru;
+}
+
+static struct ra_window *ra_find_window(struct ra_stream *s, lba_t blk)
+{
+    int i;
+    for (i = 0; i < 2; i++) {
+        struct ra_window *w = &s->win[i];
+        if (w->state != RA_EMPTY && !w->stale &&
+            blk >= w->start && blk < w->start + w->len)
+            return w;
+    }
+    return NULL;
+}
+
+/* queue the next window of a sequential stream if one of its buffers is
+ * free. The window starts where buffered data ends and is extended so it
+ * ends on a stripe boundary, which keeps every later window aligned and
+ * spread evenly across the member disks.
+ */
+static void ra_queue(struct ra_dev *ra, struct ra_stream *s)
+{
+    struct ra_window *w = NULL;
+    int i;
+    lba_t start = s->next, end;
+
+    for (i = 0; i < 2; i++) {
+        struct ra_window *x = &s->win[i];
+        if (x->state == RA_READY && x->start + x->len <= s->next)
+            x->state = RA_EMPTY;        /* fully consumed */
+        if (x->state == RA_EMPTY)
+            w = x;
+        else if (!x->stale && x->start + x->len > start)
+            start = x->start + x->len;
+    }
+    if (w == NULL || start >= ra->nblks)
+        return;
+
+    end = ra_align_up(ra, start + s->size);
+    if (end > ra->nblks)
+        end = ra->nblks;
+
+    if (w->buf == NULL) {
+        w->buf = malloc((size_t)(ra->max_window + ra->align) * ra->bs);
+        if (w->buf == NULL)
+            return;
+    }
+    w->start = start;
+    w->len = end - start;
+    w->stale = 0;
+    w->state = RA_QUEUED;
+    pthread_cond_broadcast(&ra->cond);
+}
+
+static struct ra_window *ra_next_job(struct ra_dev *ra)
+{
+    int i, j;
+    for (i = 0; i < RA_STREAMS; i++)
+        for (j = 0; j < 2; j++)
+            if (ra->streams[i].win[j].state == RA_QUEUED)
+                return &ra->streams[i].win[j];
+    return NULL;
+}
+
+/* prefetch workers - fetch queued windows in the background so the
+ * member disks keep working while the client consumes the previous one.
+ * 'dev' is safe for concurrent callers (the raid layers lock by stripe
+ * themselves), so windows of different streams are fetched in parallel
+ * with each other and with foreground I/O; a write that overlaps a
+ * window in flight marks it stale instead of waiting for it.
+ */
+static void *ra_worker(void *arg)
+{
+    struct ra_dev *ra = arg;
+    struct ra_window *w;
+    int val;
+
+    pthread_mutex_lock(&ra->lock);
+    while (!ra->stop) {
+        if ((w = ra_next_job(ra)) == NULL) {
+            pthread_cond_wait(&ra->cond, &ra->lock);
+            continue;
+        }
+        w->state = RA_INFLIGHT;
+        pthread_mutex_unlock(&ra->lock);
+
+        val = ra->dev->ops->read(ra->dev, w->start, w->len, w->buf);
+
+        pthread_mutex_lock(&ra->lock);
+        w->state = (val == SUCCESS && !w->stale) ? RA_READY : RA_EMPTY;
+        w->stale = 0;
+        pthread_cond_broadcast(&ra->cond);
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return NULL;
+}
+
+static lba_t ra_num_blocks(struct blkdev *dev)
+{
+    struct ra_dev *ra = dev->private;
+    assert(ra->magic == RA_DEV_MAGIC);
+    return ra->nblks;
+}
+
+/* copy out whatever the stream already holds, wait for windows that are
+ * on their way, and read anything else directly from the lower device.
+ */
+static int ra_read_blocks(struct blkdev *dev, lba_t first_blk, lba_t num_blks, void *buf)
+{
+    struct ra_dev *ra = dev->private;
+    struct ra_stream *s;
+    struct ra_window *w;
+    char *dst = buf;
+    lba_t blk = first_blk, left = num_blks, n;
+    int sequential, val = SUCCESS;
+
+    assert(ra->magic == RA_DEV_MAGIC);
+    if (first_blk < 0 || num_blks < 0 || num_blks > ra->nblks - first_blk)
+        return E_BADADDR;
+
+    pthread_mutex_lock(&ra->lock);
+    s = ra_find_stream(ra, first_blk);
+    sequential = (s->next == first_blk);
+    s->used = ++ra->tick;
+
+    while (left > 0 && (w = ra_find_window(s, blk)) != NULL) {
+        if (w->state != RA_READY) {
+            pthread_cond_wait(&ra->cond, &ra->lock);
+            continue;
+        }
+        n = w->start + w->len - blk;
+        if (n > left)
+            n = left;
+        memcpy(dst, w->buf + (size_t)(blk - w->start) * ra->bs,
+               (size_t)n * ra->bs);
+        blk += n;
+        dst += (size_t)n * ra->bs;
+        left -= n;
+    }
+    pthread_mutex_unlock(&ra->lock);
+
+    if (left > 0)
+        val = ra->dev->ops->read(ra->dev, blk, left, dst);
+
+    pthread_mutex_lock(&ra->lock);
+    if (val == SUCCESS && sequential) {
+        s->hits++;
+        s->size = s->size * 2;
+        if (s->size < ra->align)
+            s->size = ra->align;
+        if (s->size > ra->max_window)
+            s->size = ra->max_window;
+    } else {
+        s->hits = 0;
+        s->size = ra->align;
+    }
+    s->next = first_blk + num_blks;
+    if (s->hits >= RA_SEQ_HITS)
+        ra_queue(ra, s);
+    pthread_mutex_unlock(&ra->lock);
+
+    return val;
+}
+
+/* bring buffered windows up to date after blocks were changed below us:
+ * patch READY windows with the new data ('buf'), or drop them if there
+ * is none (discard) or the write failed; windows still being read are
+ * discarded on arrival.
+ */
+static void ra_update_windows(struct ra_dev *ra, lba_t first_blk, lba_t num_blks,
+                              void *buf, int val)
+{
+    int i, j;
+    lba_t lo, hi;
+
+    pthread_mutex_lock(&ra->lock);
+    for (i = 0; i < RA_STREAMS; i++) {
+        for (j = 0; j < 2; j++) {
+            struct ra_window *w = &ra->streams[i].win[j];
+            if (w->state == RA_EMPTY)
+                continue;
+            lo = first_blk > w->start ? first_blk : w->start;
+            hi = first_blk + num_blks < w->start + w->len ?
+                first_blk + num_blks : w->start + w->len;
+            if (lo >= hi)
+                continue;
+            if (w->state == RA_READY && val == SUCCESS && buf != NULL)
+                memcpy(w->buf + (size_t)(lo - w->start) * ra->bs,
+                       (char *)buf + (size_t)(lo - first_blk) * ra->bs,
+                       (size_t)(hi - lo) * ra->bs);
+            else if (w->state == RA_INFLIGHT)
+                w->stale = 1;
+            else
+                w->state = RA_EMPTY;
+        }
+    }
+    pthread_mutex_unlock(&ra->lock);
+}
+
+/* writes go straight through, then update the windows */
+static int ra_write_blocks(struct blkdev *dev, lba_t first_blk, lba_t num_blks, void *buf,
+                           int flags)
+{
+    struct ra_dev *ra = dev->private;
+    int val;
+
+    assert(ra->magic == RA_DEV_MAGIC);
+
+    val = blkdev_write_flags(ra->dev, first_blk, num_blks, buf, flags);
+
+    ra_update_windows(ra, first_blk, num_blks, buf, val);
+    return val;
+}
+
+static int ra_discard_blocks(struct blkdev *dev, lba_t first_blk, lba_t num_blks)
+{
+    struct ra_dev *ra = dev->private;
+    int val;
+
+    assert(ra->magic == RA_DEV_MAGIC);
+
+    val = blkdev_discard(ra->dev, first_blk, num_blks);
+
+    ra_update_windows(ra, first_blk, num_blks, NULL, val);
+    return val;
+}
+
+static int ra_write_zeroes_blocks(struct blkdev *dev, lba_t first_blk, lba_t num_blks)
+{
+    struct ra_dev *ra = dev->private;
+    int val;
+
+    assert(ra->magic == RA_DEV_MAGIC);
+
+    val = blkdev_write_zeroes(ra->dev, first_blk, num_blks);
+
+    ra_update_windows(ra, first_blk, num_blks, NULL, val);
+    return val;
+}
+
+/* nothing is buffered for writing, so a flush is just passed down */
+static int ra_flush_blocks(struct blkdev *dev)
+{
+    struct ra_dev *ra = dev->private;
+    int val;
+
+    assert(ra->magic == RA_DEV_MAGIC);
+
+    val = blkdev_flush(ra->dev);
+    return val;
+}
+
+static int ra_map_extent(struct blkdev *dev, lba_t first_blk, lba_t num_blks, lba_t *len)
+{
+    struct ra_dev *ra = dev->private;
+    return blkdev_map_extent(ra->dev, first_blk, num_blks, len);
+}
+
+static int ra_read(struct blkdev *dev, lba_t first_blk, lba_t num_blks, void *buf)
+{
+    struct ra_dev *ra = dev->private;
+    unsigned long t0 = blkdev_stats_start();
+    int val = ra_read_blocks(dev, first_blk, num_blks, buf);
+    blkdev_stats_end(&ra->stats, BLKDEV_OP_READ, num_blks, val, t0);
+    return val;
+}
+
+static int ra_write(struct blkdev *dev, lba_t first_blk, lba_t num_blks, void *buf)
+{
+    struct ra_dev *ra = dev->private;
+    unsigned long t0 = blkdev_stats_start();
+    int val = ra_write_blocks(dev, first_blk, num_blks, buf, 0);
+    blkdev_stats_end(&ra->stats, BLKDEV_OP_WRITE, num_blks, val, t0);
+    return val;
+}
+
+static int ra_write_flags(struct blkdev *dev, lba_t first_blk, lba_t num_blks, void *buf,
+                          int flags)
+{
+    struct ra_dev *ra = dev->private;
+    unsigned long t0 = blkdev_stats_start();
+    int val = ra_write_blocks(dev, first_blk, num_blks, buf, flags);
+    blkdev_stats_end(&ra->stats, BLKDEV_OP_WRITE, num_blks, val, t0);
+    return val;
+}
+
+static int ra_flush(struct blkdev *dev)
+{
+    struct ra_dev *ra = dev->private;
+    unsigned long t0 = blkdev_stats_start();
+    int val = ra_flush_blocks(dev);
+    blkdev_stats_end(&ra->stats, BLKDEV_OP_FLUSH, 0, val, t0);
+    return val;
+}
+
+static int ra_discard(struct blkdev *dev, lba_t first_blk, lba_t num_blks)
+{
+    struct ra_dev *ra = dev->private;
+    unsigned long t0 = blkdev_stats_start();
+    int val = ra_discard_blocks(dev, first_blk, num_blks);
+    blkdev_stats_end(&ra->stats, BLKDEV_OP_DISCARD, num_blks, val, t0);
+    return val;
+}
+
+static int ra_write_zeroes(struct blkdev *dev, lba_t first_blk, lba_t num_blks)
+{
+    struct ra_dev *ra = dev->private;
+    unsigned long t0 = blkdev_stats_start();
+    int val = ra_write_zeroes_blocks(dev, first_blk, num_blks);
+    blkdev_stats_end(&ra->stats, BLKDEV_OP_WRITE_ZEROES, num_blks, val, t0);
+    return val;
+}
+
+static struct blkdev_stats *ra_stats(struct blkdev *dev)
+{
+    struct ra_dev *ra = dev->private;
+    return &ra->stats;
+}
+
+static int ra_members(struct blkdev *dev, struct blkdev **out, int max)
+{
+    struct ra_dev *ra = dev->private;
+    if (max < 1)
+        return 0;
+    out[0] = ra->dev;
+    return 1;
+}
+
+static int ra_block_size(struct blkdev *dev)
+{
+    struct ra_dev *ra = dev->private;
+    return ra->bs;
+}
+
+static void ra_close(struct blkdev *dev)
+{
+    struct ra_dev *ra = dev->private;
+    int i, j;
+
+    assert(ra->magic == RA_DEV_MAGIC);
+
+    pthread_mutex_lock(&ra->lock);
+    ra->stop = 1;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+    for (i = 0; i < ra->nworkers; i++)
+        pthread_join(ra->workers[i], NULL);
+
+    ra->dev->ops->close(ra->dev);
+    for (i = 0; i < RA_STREAMS; i++)
+        for (j = 0; j < 2; j++)
+            free(ra->streams[i].win[j].buf);
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->lock);
+    free(ra);
+    free(dev);
+}
+
+struct blkdev_ops ra_ops = {
+    .num_blocks = ra_num_blocks,
+    .read = ra_read,
+    .write = ra_write,
+    .close = ra_close,
+    .stats = ra_stats,
+    .members = ra_members,
+    .block_size = ra_block_size,
+    .discard = ra_discard,
+    .write_zeroes = ra_write_zeroes,
+    .flush = ra_flush,
+    .write_flags = ra_write_flags,
+    .map_extent = ra_map_extent,
+    .name = "readahead"
+};
+
+/* create a readahead layer over 'dev'. Prefetch windows are multiples of
+ * 'align' blocks - pass the stripe width (unit * ndisks) of a raid0
+ * volume so each window covers every member equally - and double on
+ * each sequential read up to 'max_window' blocks. Closing the readahead
+ * device closes 'dev'.
+ */
+struct blkdev *readahead_create(struct blkdev *dev, lba_t align, lba_t max_window)
+{
+    struct blkdev *rdev;
+    struct ra_dev *ra;
+    int i;
+
+    if (dev == NULL || align < 1)
+        return NULL;
+    if (max_window < align)
+        max_window = align;
+    max_window = max_window / align * align;
+
+    rdev = malloc(sizeof(*rdev));
+    ra = calloc(1, sizeof(*ra));
+    if (rdev == NULL || ra == NULL) {
+        free(rdev);
+        free(ra);
+        return NULL;
+    }
+
+    ra->magic = RA_DEV_MAGIC;
+    ra->dev = dev;
+    ra->nblks = dev->ops->num_blocks(dev);
+    ra->bs = blkdev_block_size(dev);
+    ra->align = align;
+    ra->max_window = max_window;
+    for (i = 0; i < RA_STREAMS; i++)
+        ra_reset_stream(&ra->streams[i]);
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+
+    for (i = 0; i < RA_WORKERS; i++) {
+        if (pthread_create(&ra->workers[i], NULL, ra_worker, ra) != 0)
+            break;
+        ra->nworkers++;
+    }
+    if (ra->nworkers == 0) {
+        fprintf(stderr, "readahead: can't start prefetch thread\n");
+        pthread_cond_destroy(&ra->cond);
+        pthread_mutex_destroy(&ra->lock);
+        free(ra);
+        free(rdev);
+        return NULL;
+    }
+
+    rdev->private = ra;
+    rdev->ops = &ra_ops;
+    return rdev;
+}
@@ -0,0 +1,157 @@
+#include "blkdev.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+
+#define NBLKS 4096
+#define MS    1000000UL
+
+static unsigned long now_ns(void)
+{
+    return blkdev_stats_start();
+}
+
+/* 'n' single-block reads, one result per read */
+static void read_pattern(struct blkdev *dev, int n, int *result)
+{
+    char buf[BLOCK_SIZE];
+    for (int i = 0; i < n; i++)
+        result[i] = blkdev_read(dev, (i * 37) % NBLKS, 1, buf);
+}
+
+static void *reader(void *dev)
+{
+    char buf[BLOCK_SIZE];
+    assert(blkdev_read(dev, 0, 1, buf) == SUCCESS);
+    return NULL;
+}
+
+/* time for 'n' threads to each do one read */
+static unsigned long parallel_reads(struct blkdev *dev, int n)
+{
+    pthread_t t[n];
+    unsigned long t0 = now_ns();
+    for (int i = 0; i < n; i++)
+        assert(pthread_create(&t[i], NULL, reader, dev) == 0);
+    for (int i = 0; i < n; i++)
+        pthread_join(t[i], NULL);
+    return now_ns() - t0;
+}
+
+int main() {
+    struct sim_params p;
+    char *buf = malloc(128 * BLOCK_SIZE);
+    unsigned long t0, t, serial;
+
+    // the same seed gives the same failures, a different one doesn't
+    memset(&p, 0, sizeof(p));
+    p.error_prob = 0.3;
+    p.seed = 42;
+    struct blkdev *a = sim_create(ramdisk_create(NBLKS), &p);
+    struct blkdev *b = sim_create(ramdisk_create(NBLKS), &p);
+    p.seed = 43;
+    struct blkdev *c = sim_create(ramdisk_create(NBLKS), &p);
+    int ra[200], rb[200], rc[200], fails = 0;
+    read_pattern(a, 200, ra);
+    read_pattern(b, 200, rb);
+    read_pattern(c, 200, rc);
+    assert(memcmp(ra, rb, sizeof(ra)) == 0);
+    assert(memcmp(ra, rc, sizeof(ra)) != 0);
+    for (int i = 0; i < 200; i++) {
+        assert(ra[i] == SUCCESS || ra[i] == E_UNAVAIL);
+        fails += ra[i] != SUCCESS;
+    }
+    assert(fails > 20 && fails < 100);
+
+    // failures are intermittent, and go away when reconfigured
+    p.error_prob = 0;
+    sim_configure(a, &p);
+    read_pattern(a, 200, ra);
+    for (int i = 0; i < 200; i++)
+        assert(ra[i] == SUCCESS);
+    assert(blkdev_read(a, NBLKS, 1, buf) == E_BADADDR);
+    blkdev_close(b);
+    blkdev_close(c);
+
+    // data goes through to the device underneath
+    memset(buf, 0x3c, BLOCK_SIZE);
+    assert(blkdev_write(a, 7, 1, buf) == SUCCESS);
+    memset(buf, 0, BLOCK_SIZE);
+    assert(blkdev_read(a, 7, 1, buf) == SUCCESS);
+    assert(buf[0] == 0x3c && buf[BLOCK_SIZE - 1] == 0x3c);
+
+    // fixed latency
+    p.lat_dist = SIM_LAT_FIXED;
+    p.lat_ns = 5 * MS;
+    sim_configure(a, &p);
+    t0 = now_ns();
+    assert(blkdev_read(a, 8, 1, buf) == SUCCESS);
+    assert(now_ns() - t0 >= 5 * MS);
+
+    // queue depth: one in service at a time, or all four at once
+    p.qdepth = 1;
+    sim_configure(a, &p);
+    serial = parallel_reads(a, 4);
+    assert(serial >= 20 * MS);
+    p.qdepth = 4;
+    sim_configure(a, &p);
+    t = parallel_reads(a, 4);
+    assert(t >= 5 * MS && t < serial);
+
+    // bandwidth: 64 KiB at 4 MB/s takes at least 16ms
+    memset(&p, 0, sizeof(p));
+    p.bandwidth = 4e6;
+    sim_configure(a, &p);
+    t0 = now_ns();
+    assert(blkdev_read(a, 0, 128, buf) == SUCCESS);
+    assert(now_ns() - t0 >= 16 * MS);
+
+    // seeks cost with distance; sequential reads don't seek
+    memset(&p, 0, sizeof(p));
+    p.seek_full_ns = 20 * MS;
+    sim_configure(a, &p);
+    assert(blkdev_read(a, 0, 1, buf) == SUCCESS);
+    t0 = now_ns();
+    assert(blkdev_read(a, 1, 8, buf) == SUCCESS);
+    t = now_ns() - t0;
+    t0 = now_ns();
+    assert(blkdev_read(a, NBLKS - 1, 1, buf) == SUCCESS);
+    assert(now_ns() - t0 >= 19 * MS);
+    assert(t < now_ns() - t0);
+
+    // heavy-tailed latency never goes below the pareto minimum
+    memset(&p, 0, sizeof(p));
+    p.lat_dist = SIM_LAT_PARETO;
+    p.lat_ns = 100000;
+    p.pareto_alpha = 1.5;
+    p.seed = 7;
+    b = sim_create(ramdisk_create(NBLKS), &p);
+    t0 = now_ns();
+    read_pattern(b, 50, ra);
+    t = now_ns() - t0;
+    assert(t >= 50 * 100000UL);
+    struct blkdev_stats st;
+    assert(blkdev_get_stats(b, &st) == SUCCESS);
+    assert(st.op[BLKDEV_OP_READ].ops == 50 && st.op[BLKDEV_OP_READ].errors == 0);
+    blkdev_close(b);
+
+    // a mirror rides out a member that fails now and then
+    memset(&p, 0, sizeof(p));
+    p.error_prob = 0.5;
+    p.seed = 3;
+    struct blkdev *sides[2] = {sim_create(ramdisk_create(NBLKS), &p), ramdisk_create(NBLKS)};
+    struct blkdev *mirror = mirror_create(sides);
+    for (int i = 0; i < 100; i++) {
+        assert(blkdev_write(mirror, i, 1, buf) == SUCCESS);
+        assert(blkdev_read(mirror, i, 1, buf) == SUCCESS);
+    }
+    blkdev_close(mirror);
+
+    blkdev_close(a);
+    free(buf);
+    printf("sim test passed\n");
+}
@@ -0,0 +1 @@
+gcc -g -w -pthread -o sim-test sim-test.c sim.c ramdisk.c image.c raid.c integrity.c -lm && ./sim-test
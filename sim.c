@@ -0,0 +1,308 @@
+/*
+ * file:        sim.c
+ * description: simulated device timing and failures, stackable in
+ *              front of any blkdev (typically a ramdisk)
+ *
+ * The underlying device does the I/O; the sim layer decides how long
+ * each op takes and whether it fails. An op's service time is a draw
+ * from the latency distribution, plus an occasional spike, plus a seek
+ * cost for the distance from where the last op left the head. Transfers
+ * share a bandwidth budget, so ops queue behind each other for it, and
+ * at most qdepth ops are in service at once. Ops fail with E_UNAVAIL at
+ * random, without the device staying failed, and always if they touch
+ * the bad blocks.
+ *
+ * All random draws come from one generator seeded from the parameters
+ * and are taken in arrival order, so a single-threaded workload sees
+ * the same latencies and failures on every run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "blkdev.h"
+
+#define SIM_DEV_MAGIC 0x12340020
+
+struct sim_dev {
+    int magic;
+    struct blkdev *dev;
+    lba_t nblks;
+    struct sim_params p;
+    pthread_mutex_t lock;       /* protects everything below */
+    pthread_cond_t cond;        /* an op left service */
+    uint64_t rng;
+    int inflight;
+    lba_t head;                 /* block after the last op */
+    unsigned long bw_free;      /* when the transfer budget is next free, ns */
+    struct blkdev_stats stats;
+};
+
+/* xorshift64*, as a double in [0, 1) */
+static double sim_rand(struct sim_dev *sd)
+{
+    sd->rng ^= sd->rng >> 12;
+    sd->rng ^= sd->rng << 25;
+    sd->rng ^= sd->rng >> 27;
+    return ((sd->rng * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / (1ULL << 53));
+}
+
+static double sim_latency(struct sim_dev *sd)
+{
+    double u = sim_rand(sd), lat = sd->p.lat_ns;
+
+    switch (sd->p.lat_dist) {
+    case SIM_LAT_UNIFORM:
+        return lat * u;
+    case SIM_LAT_EXP:
+        return -lat * log(1 - u);
+    case SIM_LAT_PARETO:
+        return sd->p.pareto_alpha > 0 ? lat / pow(1 - u, 1 / sd->p.pareto_alpha) : lat;
+    }
+    return lat;
+}
+
+/* admit an op on [first, first+n) moving 'bytes' of data. Returns when
+ * it completes (ns), or 0 if it is to fail.
+ */
+static unsigned long sim_begin(struct sim_dev *sd, lba_t first, lba_t n, size_t bytes)
+{
+    unsigned long now, done;
+    double t;
+    int fail;
+
+    pthread_mutex_lock(&sd->lock);
+    while (sd->p.qdepth > 0 && sd->inflight >= sd->p.qdepth)
+        pthread_cond_wait(&sd->cond, &sd->lock);
+    sd->inflight++;
+    now = blkdev_stats_start();
+
+    t = sim_latency(sd);
+    if (sd->p.spike_prob > 0 && sim_rand(sd) < sd->p.spike_prob)
+        t += sd->p.spike_ns;
+    if (n > 0 && first != sd->head && (sd->p.seek_ns || sd->p.seek_full_ns)) {
+        lba_t dist = first > sd->head ? first - sd->head : sd->head - first;
+        t += sd->p.seek_ns + sd->p.seek_full_ns * sqrt((double)dist / sd->nblks);
+    }
+    done = now + (unsigned long)t;
+    if (sd->p.bandwidth > 0 && bytes > 0) {
+        unsigned long start = sd->bw_free > now ? sd->bw_free : now;
+        sd->bw_free = start + (unsigned long)(bytes * 1e9 / sd->p.bandwidth);
+        if (sd->bw_free > done)
+            done = sd->bw_free;
+    }
+    fail = sd->p.error_prob > 0 && sim_rand(sd) < sd->p.error_prob;
+    fail |= n > 0 && first < sd->p.bad_first + sd->p.bad_blocks && first + n > sd->p.bad_first;
+    if (n > 0)
+        sd->head = first + n;
+    pthread_mutex_unlock(&sd->lock);
+    return fail ? 0 : done;
+}
+
+/* wait out the op's service time and let the next one in */
+static void sim_end(struct sim_dev *sd, unsigned long done)
+{
+    struct timespec ts = {done / 1000000000UL, done % 1000000000UL};
+
+    if (done != 0)
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+            ;
+    pthread_mutex_lock(&sd->lock);
+    sd->inflight--;
+    pthread_cond_signal(&sd->cond);
+    pthread_mutex_unlock(&sd->lock);
+}
+
+static int sim_in_range(struct sim_dev *sd, lba_t first, lba_t n)
+{
+    return first >= 0 && n >= 0 && first <= sd->nblks - n;
+}
+
+static lba_t sim_num_blocks(struct blkdev *dev)
+{
+    struct sim_dev *sd = dev->private;
+    return sd->nblks;
+}
+
+static int sim_block_size(struct blkdev *dev)
+{
+    struct sim_dev *sd = dev->private;
+    return blkdev_block_size(sd->dev);
+}
+
+static int sim_read(struct blkdev *dev, lba_t first_blk, lba_t num_blks, void *buf)
+{
+    struct sim_dev *sd = dev->private;
+    unsigned long t0 = blkdev_stats_start(), done;
+    int val = E_BADADDR;
+
+    assert(sd->magic == SIM_DEV_MAGIC);
+    if (sim_in_range(sd, first_blk, num_blks)) {
+        done = sim_begin(sd, first_blk, num_blks, (size_t)num_blks * blkdev_block_size(sd->dev));
+        val = done ? sd->dev->ops->read(sd->dev, first_blk, num_blks, buf) : E_UNAVAIL;
+        sim_end(sd, done);
+    }
+    blkdev_stats_end(&sd->stats, BLKDEV_OP_READ, num_blks, val, t0);
+    return val;
+}
+
+static int sim_write_flags(struct blkdev *dev, lba_t first_blk, lba_t num_blks, void *buf,
+                           int flags)
+{
+    struct sim_dev *sd = dev->private;
+    unsigned long t0 = blkdev_stats_start(), done;
+    int val = E_BADADDR;
+
+    assert(sd->magic == SIM_DEV_MAGIC);
+    if (sim_in_range(sd, first_blk, num_blks)) {
+        done = sim_begin(sd, first_blk, num_blks, (size_t)num_blks * blkdev_block_size(sd->dev));
+        val = done ? blkdev_write_flags(sd->dev, first_blk, num_blks, buf, flags) : E_UNAVAIL;
+        sim_end(sd, done);
+    }
+    blkdev_stats_end(&sd->stats, BLKDEV_OP_WRITE, num_blks, val, t0);
+    return val;
+}
+
+static int sim_write(struct blkdev *dev, lba_t first_blk, lba_t num_blks, void *buf)
+{
+    return sim_write_flags(dev, first_blk, num_blks, buf, 0);
+}
+
+/* discard and write_zeroes move no data: latency and seek only */
+static int sim_discard(struct blkdev *dev, lba_t first_blk, lba_t num_blks)
+{
+    struct sim_dev *sd = dev->private;
+    unsigned long t0 = blkdev_stats_start(), done;
+    int val = E_BADADDR;
+
+    if (sim_in_range(sd, first_blk, num_blks)) {
+        done = sim_begin(sd, first_blk, num_blks, 0);
+        val = done ? blkdev_discard(sd->dev, first_blk, num_blks) : E_UNAVAIL;
+        sim_end(sd, done);
+    }
+    blkdev_stats_end(&sd->stats, BLKDEV_OP_DISCARD, num_blks, val, t0);
+    return val;
+}
+
+static int sim_write_zeroes(struct blkdev *dev, lba_t first_blk, lba_t num_blks)
+{
+    struct sim_dev *sd = dev->private;
+    unsigned long t0 = blkdev_stats_start(), done;
+    int val = E_BADADDR;
+
+    if (sim_in_range(sd, first_blk, num_blks)) {
+        done = sim_begin(sd, first_blk, num_blks, 0);
+        val = done ? blkdev_write_zeroes(sd->dev, first_blk, num_blks) : E_UNAVAIL;
+        sim_end(sd, done);
+    }
+    blkdev_stats_end(&sd->stats, BLKDEV_OP_WRITE_ZEROES, num_blks, val, t0);
+    return val;
+}
+
+static int sim_flush(struct blkdev *dev)
+{
+    struct sim_dev *sd = dev->private;
+    unsigned long t0 = blkdev_stats_start(), done;
+    int val;
+
+    done = sim_begin(sd, 0, 0, 0);
+    val = done ? blkdev_flush(sd->dev) : E_UNAVAIL;
+    sim_end(sd, done);
+    blkdev_stats_end(&sd->stats, BLKDEV_OP_FLUSH, 0, val, t0);
+    return val;
+}
+
+static int sim_map_extent(struct blkdev *dev, lba_t first_blk, lba_t num_blks, lba_t *len)
+{
+    struct sim_dev *sd = dev->private;
+    return blkdev_map_extent(sd->dev, first_blk, num_blks, len);
+}
+
+static struct blkdev_stats *sim_stats(struct blkdev *dev)
+{
+    struct sim_dev *sd = dev->private;
+    return &sd->stats;
+}
+
+static int sim_members(struct blkdev *dev, struct blkdev **out, int max)
+{
+    struct sim_dev *sd = dev->private;
+    if (max < 1)
+        return 0;
+    out[0] = sd->dev;
+    return 1;
+}
+
+static void sim_close(struct blkdev *dev)
+{
+    struct sim_dev *sd = dev->private;
+
+    assert(sd->magic == SIM_DEV_MAGIC);
+    sd->dev->ops->close(sd->dev);
+    pthread_cond_destroy(&sd->cond);
+    pthread_mutex_destroy(&sd->lock);
+    free(sd);
+    free(dev);
+}
+
+struct blkdev_ops sim_ops = {
+    .num_blocks = sim_num_blocks,
+    .read = sim_read,
+    .write = sim_write,
+    .close = sim_close,
+    .stats = sim_stats,
+    .members = sim_members,
+    .block_size = sim_block_size,
+    .discard = sim_discard,
+    .write_zeroes = sim_write_zeroes,
+    .flush = sim_flush,
+    .write_flags = sim_write_flags,
+    .map_extent = sim_map_extent,
+    .name = "sim"
+};
+
+void sim_configure(struct blkdev *dev, const struct sim_params *p)
+{
+    struct sim_dev *sd = dev->private;
+
+    assert(sd->magic == SIM_DEV_MAGIC);
+    pthread_mutex_lock(&sd->lock);
+    sd->p = *p;
+    pthread_cond_broadcast(&sd->cond);      /* qdepth may have grown */
+    pthread_mutex_unlock(&sd->lock);
+}
+
+/* create a simulated device in front of 'dev', which it closes on close */
+struct blkdev *sim_create(struct blkdev *dev, const struct sim_params *p)
+{
+    struct blkdev *sdev;
+    struct sim_dev *sd;
+
+    if (dev == NULL || p == NULL)
+        return NULL;
+
+    sdev = malloc(sizeof(*sdev));
+    sd = calloc(1, sizeof(*sd));
+    if (sdev == NULL || sd == NULL) {
+        free(sdev);
+        free(sd);
+        return NULL;
+    }
+
+    sd->magic = SIM_DEV_MAGIC;
+    sd->dev = dev;
+    sd->nblks = dev->ops->num_blocks(dev);
+    sd->p = *p;
+    sd->rng = p->seed ? p->seed : 1;        /* xorshift must not start at 0 */
+    pthread_mutex_init(&sd->lock, NULL);
+    pthread_cond_init(&sd->cond, NULL);
+
+    sdev->private = sd;
+    sdev->ops = &sim_ops;
+    return sdev;
+}